@@ -25,6 +25,7 @@
 #define TRAINTASTIC_CS_PIN_RX 0
 #define TRAINTASTIC_CS_PIN_TX 1
 #define TRAINTASTIC_CS_UART uart0
+#define TRAINTASTIC_CS_UART_IRQ UART0_IRQ
 
 //#define S88_PIN_POWER
 #define S88_PIN_DATA 10
@@ -34,6 +35,14 @@
 #define S88_PIO pio0
 #define S88_SM 2
 
+// Additional S88 chains (S88_2_ .. S88_4_), scanned in parallel, uncomment to enable:
+//#define S88_2_PIN_DATA 17
+//#define S88_2_PIN_CLOCK 18
+//#define S88_2_PIN_LOAD 19
+//#define S88_2_PIN_RESET 20
+//#define S88_2_PIO pio1
+//#define S88_2_SM 0
+
 #define XPRESSNET_PIN_POWER PICO_DEFAULT_LED_PIN // LED for testing now
 #define XPRESSNET_PIN_RX 14
 #define XPRESSNET_PIN_TX 15
@@ -30,7 +30,28 @@
 int main()
 {
   // Binary info:
+  bi_decl(bi_1pin_with_name(S88_PIN_DATA, "S88 data"));
   bi_decl(bi_1pin_with_name(S88_PIN_CLOCK, "S88 clock"));
+  bi_decl(bi_1pin_with_name(S88_PIN_LOAD, "S88 load"));
+  bi_decl(bi_1pin_with_name(S88_PIN_RESET, "S88 reset"));
+#ifdef S88_2_PIO
+  bi_decl(bi_1pin_with_name(S88_2_PIN_DATA, "S88 chain 2 data"));
+  bi_decl(bi_1pin_with_name(S88_2_PIN_CLOCK, "S88 chain 2 clock"));
+  bi_decl(bi_1pin_with_name(S88_2_PIN_LOAD, "S88 chain 2 load"));
+  bi_decl(bi_1pin_with_name(S88_2_PIN_RESET, "S88 chain 2 reset"));
+#endif
+#ifdef S88_3_PIO
+  bi_decl(bi_1pin_with_name(S88_3_PIN_DATA, "S88 chain 3 data"));
+  bi_decl(bi_1pin_with_name(S88_3_PIN_CLOCK, "S88 chain 3 clock"));
+  bi_decl(bi_1pin_with_name(S88_3_PIN_LOAD, "S88 chain 3 load"));
+  bi_decl(bi_1pin_with_name(S88_3_PIN_RESET, "S88 chain 3 reset"));
+#endif
+#ifdef S88_4_PIO
+  bi_decl(bi_1pin_with_name(S88_4_PIN_DATA, "S88 chain 4 data"));
+  bi_decl(bi_1pin_with_name(S88_4_PIN_CLOCK, "S88 chain 4 clock"));
+  bi_decl(bi_1pin_with_name(S88_4_PIN_LOAD, "S88 chain 4 load"));
+  bi_decl(bi_1pin_with_name(S88_4_PIN_RESET, "S88 chain 4 reset"));
+#endif
   bi_decl(bi_1pin_with_name(TRAINTASTIC_CS_PIN_RX, "Traintastic CS Rx"));
   bi_decl(bi_1pin_with_name(TRAINTASTIC_CS_PIN_TX, "Traintastic CS Tx"));
   bi_decl(bi_1pin_with_name(XPRESSNET_PIN_RX, "XpressNet Rx"));
@@ -46,7 +67,6 @@ int main()
     TraintasticCS::process();
     S88::process();
     XpressNet::process();
-    sleep_us(100); // FIXME: if lower, xpressnet rx fifo contains garbage
   }
 }
 
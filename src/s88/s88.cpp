@@ -22,44 +22,175 @@
 #include "s88.hpp"
 #include "s88.pio.h"
 #include <algorithm>
+#include <array>
 #include <pico/stdlib.h>
 #include <hardware/clocks.h>
+#include <hardware/dma.h>
+#include <hardware/irq.h>
 #include <hardware/pio.h>
+#include <hardware/sync.h>
 #include "../config.hpp"
 #include "../traintasticcs/input.hpp"
 #include "../utils/time.hpp"
 
 namespace S88 {
 
+constexpr uint wordSize = 32;
+constexpr uint detectInputCount = 8 * (moduleCountMax + 1); // auto detect reads one extra module
+constexpr uint detectScanCount = 8;
+constexpr uint wordCountMax = 1 + detectInputCount / wordSize; // at multiple of wordSize there is a dummy push
+
+struct Chain
+{
+  PIO pio;
+  uint sm;
+  uint pinData;
+  uint pinClock; // clock, load and reset must be consecutive pins
+
+  pio_sm_config config = {};
+  uint dmaChannel = 0;
+  bool enabled = false;
+  bool detecting = false; // auto detecting module count
+  uint8_t detectScans = 0;
+  uint16_t detectLength = 0; // inputs, highest input that differs from the fill level + 1
+  uint16_t inputCount = 0;
+  uint16_t firstAddress = 0;
+  std::array<std::array<uint32_t, wordCountMax>, 2> buffers = {}; // double buffered, written by DMA
+  volatile uint8_t scanBuffer = 0; // buffer DMA is writing to
+  volatile uint32_t scanCount = 0; // number of completed scans, last completed is in the other buffer
+  volatile bool scanActive = false;
+  std::array<uint32_t, 2> scanStart = {}; // time_us_32() at load pulse, per buffer
+  std::array<uint16_t, 2> scanInputCount = {}; // inputCount the scan was started with, per buffer
+  volatile uint32_t scanDuration = 0; // us, of last completed scan
+  uint32_t scanCountProcessed = 0;
+  uint32_t scanCountSecond = 0; // scanCount at start of the current measurement second
+  uint32_t scansPerSecond = 0;
+};
+
+static_assert(S88_PIN_LOAD == S88_PIN_CLOCK + 1 && S88_PIN_RESET == S88_PIN_CLOCK + 2);
+#ifdef S88_2_PIO
+static_assert(S88_2_PIN_LOAD == S88_2_PIN_CLOCK + 1 && S88_2_PIN_RESET == S88_2_PIN_CLOCK + 2);
+#endif
+#ifdef S88_3_PIO
+static_assert(S88_3_PIN_LOAD == S88_3_PIN_CLOCK + 1 && S88_3_PIN_RESET == S88_3_PIN_CLOCK + 2);
+#endif
+#ifdef S88_4_PIO
+static_assert(S88_4_PIN_LOAD == S88_4_PIN_CLOCK + 1 && S88_4_PIN_RESET == S88_4_PIN_CLOCK + 2);
+#endif
+
+static Chain g_chains[] = {
+  {S88_PIO, S88_SM, S88_PIN_DATA, S88_PIN_CLOCK},
+#ifdef S88_2_PIO
+  {S88_2_PIO, S88_2_SM, S88_2_PIN_DATA, S88_2_PIN_CLOCK},
+#endif
+#ifdef S88_3_PIO
+  {S88_3_PIO, S88_3_SM, S88_3_PIN_DATA, S88_3_PIN_CLOCK},
+#endif
+#ifdef S88_4_PIO
+  {S88_4_PIO, S88_4_SM, S88_4_PIN_DATA, S88_4_PIN_CLOCK},
+#endif
+};
+static_assert(std::size(g_chains) <= chainCountMax);
+
 static bool g_enabled = false;
-static uint g_offset;
-static pio_sm_config g_config;
-static uint16_t g_inputCount;
+static bool g_scanning = false;
+static std::array<int, NUM_PIOS> g_offsets; // program offset per PIO, -1 if not loaded
+static volatile uint32_t g_scanInterval = 0; // us, zero is back-to-back
 static absolute_time_t g_nextScan;
-static uint g_fifoRead;
-static uint g_inputIndex;
+static absolute_time_t g_nextSecond;
+static uint64_t g_latencySum; // us
+static uint32_t g_latencyCount;
+static uint32_t g_latencyMax; // us
+
+static void startScan(Chain& chain)
+{
+  // DMA drains the PIO RX FIFO, writing the (number of inputs - 2) to the TX FIFO starts the scan:
+  chain.scanActive = true;
+  chain.scanStart[chain.scanBuffer] = time_us_32(); // also the timestamp of the sampled inputs
+  chain.scanInputCount[chain.scanBuffer] = chain.inputCount;
+  dma_channel_set_write_addr(chain.dmaChannel, chain.buffers[chain.scanBuffer].data(), true);
+  pio_sm_put(chain.pio, chain.sm, chain.inputCount - 2);
+}
+
+static void dmaIRQ()
+{
+  for(auto& chain : g_chains)
+  {
+    if(!dma_channel_get_irq0_status(chain.dmaChannel))
+    {
+      continue; // not for this chain
+    }
+    dma_channel_acknowledge_irq0(chain.dmaChannel);
+
+    if(!chain.enabled)
+    {
+      continue;
+    }
+
+    // scan complete, swap buffers and start next scan if running back-to-back:
+    chain.scanDuration = time_us_32() - chain.scanStart[chain.scanBuffer];
+    chain.scanBuffer ^= 1;
+    chain.scanCount++;
+    if(g_scanInterval == 0 && !chain.detecting)
+    {
+      startScan(chain);
+    }
+    else
+    {
+      chain.scanActive = false; // next scan is started by process()
+    }
+  }
+}
 
 void init()
 {
   //gpio_init(S88_PIN_POWER);
   //gpio_set_dir(S88_PIN_POWER, GPIO_OUT);
 
-  // setup pio:
-  pio_gpio_init(S88_PIO, S88_PIN_DATA);
-  pio_gpio_init(S88_PIO, S88_PIN_CLOCK);
-  pio_gpio_init(S88_PIO, S88_PIN_LOAD);
-  pio_gpio_init(S88_PIO, S88_PIN_RESET);
+  g_offsets.fill(-1);
 
-  pio_sm_set_consecutive_pindirs(S88_PIO, S88_SM, S88_PIN_CLOCK, 3, true);
+  for(auto& chain : g_chains)
+  {
+    // setup pio:
+    pio_gpio_init(chain.pio, chain.pinData);
+    pio_gpio_init(chain.pio, chain.pinClock);
+    pio_gpio_init(chain.pio, chain.pinClock + 1); // load
+    pio_gpio_init(chain.pio, chain.pinClock + 2); // reset
+
+    pio_sm_set_consecutive_pindirs(chain.pio, chain.sm, chain.pinClock, 3, true);
+
+    auto& offset = g_offsets[pio_get_index(chain.pio)];
+    if(offset < 0) // program is loaded once per PIO, shared by all its state machines
+    {
+      offset = pio_add_program(chain.pio, &s88_program);
+    }
+    chain.config = s88_program_get_default_config(offset);
 
-  g_offset = pio_add_program(S88_PIO, &s88_program);
-  g_config = s88_program_get_default_config(g_offset);
+    sm_config_set_set_pins(&chain.config, chain.pinClock, 3);
+    sm_config_set_sideset_pins(&chain.config, chain.pinClock);
+    sm_config_set_in_pins(&chain.config, chain.pinData);
 
-  sm_config_set_set_pins(&g_config, S88_PIN_CLOCK, 3);
-  sm_config_set_sideset_pins(&g_config, S88_PIN_CLOCK);
-  sm_config_set_in_pins(&g_config, S88_PIN_DATA);
+    sm_config_set_in_shift(&chain.config, true, true, wordSize); // right shift, autopush
 
-  sm_config_set_out_shift(&g_config, true, true, 32); // right shift, autopush
+    // setup dma, PIO RX FIFO -> buffer:
+    chain.dmaChannel = dma_claim_unused_channel(true);
+    dma_channel_config config = dma_channel_get_default_config(chain.dmaChannel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+    channel_config_set_read_increment(&config, false);
+    channel_config_set_write_increment(&config, true);
+    channel_config_set_dreq(&config, pio_get_dreq(chain.pio, chain.sm, false));
+    dma_channel_configure(chain.dmaChannel, &config, chain.buffers[0].data(), &chain.pio->rxf[chain.sm], 0, false);
+
+    dma_channel_set_irq0_enabled(chain.dmaChannel, true);
+  }
+
+  irq_add_shared_handler(DMA_IRQ_0, dmaIRQ, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+  irq_set_enabled(DMA_IRQ_0, true);
+}
+
+uint8_t chainCount()
+{
+  return std::size(g_chains);
 }
 
 bool enabled()
@@ -67,23 +198,108 @@ bool enabled()
   return g_enabled;
 }
 
-void enable(uint8_t moduleCount, uint8_t clockFrequency)
+bool detecting()
 {
-  //gpio_put(S88_PIN_POWER, 1);
+  return std::any_of(std::begin(g_chains), std::end(g_chains),
+    [](const Chain& chain)
+    {
+      return chain.detecting;
+    });
+}
 
-  pio_sm_set_enabled(S88_PIO, S88_SM, false);
+uint8_t moduleCount(uint8_t chain)
+{
+  return (chain < std::size(g_chains) && g_chains[chain].enabled) ? g_chains[chain].inputCount / 8 : 0;
+}
+
+static void setInputCount(Chain& chain, uint16_t inputCount)
+{
+  chain.inputCount = inputCount;
+  dma_channel_set_trans_count(chain.dmaChannel, 1 + (chain.inputCount / wordSize), false);
+}
+
+static void updateAddresses()
+{
+  // chains are mapped to contiguous input addresses:
+  uint16_t address = 1;
+  for(auto& chain : g_chains)
+  {
+    if(chain.enabled)
+    {
+      chain.firstAddress = address;
+      address += chain.inputCount;
+    }
+  }
+}
+
+void enable(const uint8_t* moduleCounts, uint8_t chainCount, uint8_t clockFrequency)
+{
+  //gpio_put(S88_PIN_POWER, 1);
 
   const float div = (float)clock_get_hz(clk_sys) / (4 * clockFrequency * 1000);
-  sm_config_set_clkdiv(&g_config, div);
 
-  pio_sm_init(S88_PIO, S88_SM, g_offset, &g_config);
+  for(uint8_t i = 0; i < chainCount && i < std::size(g_chains); ++i)
+  {
+    auto& chain = g_chains[i];
+
+    pio_sm_set_enabled(chain.pio, chain.sm, false);
+    sm_config_set_clkdiv(&chain.config, div);
+    pio_sm_init(chain.pio, chain.sm, g_offsets[pio_get_index(chain.pio)], &chain.config);
+    pio_sm_set_enabled(chain.pio, chain.sm, true);
 
-  pio_sm_set_enabled(S88_PIO, S88_SM, true);
+    chain.detecting = (moduleCounts[i] == moduleCountAutoDetect);
+    chain.detectScans = 0;
+    chain.detectLength = 0;
+    setInputCount(chain, chain.detecting ? detectInputCount : moduleCounts[i] * 8);
+    chain.scanBuffer = 0;
+    chain.scanCount = 0;
+    chain.scanActive = false;
+    chain.scanDuration = 0;
+    chain.scanCountProcessed = 0;
+    chain.scanCountSecond = 0;
+    chain.scansPerSecond = 0;
+    chain.enabled = true;
+  }
 
-  g_inputCount = moduleCount * 8;
+  updateAddresses();
+  g_latencySum = 0;
+  g_latencyCount = 0;
+  g_latencyMax = 0;
+  g_scanning = false;
   g_enabled = true;
   g_nextScan = make_timeout_time_ms(1000);
-  g_fifoRead = 0;
+}
+
+void setScanInterval(uint16_t interval)
+{
+  g_scanInterval = interval * 1000u;
+  if(g_scanning)
+  {
+    g_nextScan = get_absolute_time(); // apply immediately
+  }
+}
+
+Statistics getStatistics()
+{
+  Statistics statistics;
+  statistics.scanInterval = g_scanInterval;
+  statistics.scansPerSecond = UINT32_MAX;
+  statistics.scanDuration = 0;
+  for(const auto& chain : g_chains)
+  {
+    if(chain.enabled)
+    {
+      statistics.scansPerSecond = std::min(statistics.scansPerSecond, chain.scansPerSecond);
+      statistics.scanDuration = std::max(statistics.scanDuration, static_cast<uint32_t>(chain.scanDuration));
+    }
+  }
+  if(statistics.scansPerSecond == UINT32_MAX)
+  {
+    statistics.scansPerSecond = 0; // no chain enabled
+  }
+  statistics.latencyAverage = (g_latencyCount != 0) ? static_cast<uint32_t>(g_latencySum / g_latencyCount) : 0;
+  statistics.latencyMax = g_latencyMax;
+  return statistics;
 }
 
 void disable()
@@ -91,51 +307,218 @@ void disable()
   //gpio_put(S88_PIN_POWER, 0);
 
   g_enabled = false;
+  g_scanning = false;
+  for(auto& chain : g_chains)
+  {
+    chain.enabled = false;
+    chain.detecting = false;
+    dma_channel_abort(chain.dmaChannel);
+    pio_sm_set_enabled(chain.pio, chain.sm, false);
+  }
 }
 
-void process()
+static inline bool getBit(const std::array<uint32_t, wordCountMax>& values, uint index)
 {
-  if(!g_enabled)
+  return values[index / wordSize] & (1u << (index % wordSize));
+}
+
+/**
+ * The data input of the last module of the chain has a fixed level, after
+ * the last input this level is shifted out. The module count is determined
+ * by the last input that differs from this fill level, over multiple scans.
+ * Trailing modules with all inputs at the fill level can't be detected, if
+ * no input differs at all the chain is scanned at the maximum length.
+ */
+static void detect(Chain& chain, const std::array<uint32_t, wordCountMax>& values)
+{
+  const uint extraModule = 8 * moduleCountMax;
+  const bool fill = getBit(values, extraModule);
+
+  bool uniform = true;
+  for(uint i = extraModule + 1; i < detectInputCount; ++i)
+  {
+    uniform &= (getBit(values, i) == fill);
+  }
+
+  if(!uniform) // extra module isn't a fill level, chain is at least moduleCountMax long
+  {
+    chain.detectLength = extraModule;
+  }
+  else
+  {
+    for(uint i = extraModule; i > chain.detectLength; --i)
+    {
+      if(getBit(values, i - 1) != fill)
+      {
+        chain.detectLength = i;
+        break;
+      }
+    }
+  }
+
+  if(++chain.detectScans == detectScanCount)
+  {
+    const uint8_t moduleCount = (chain.detectLength == 0) ? moduleCountMax : std::clamp<uint8_t>((chain.detectLength + 7) / 8, moduleCountMin, moduleCountMax);
+    setInputCount(chain, moduleCount * 8);
+    chain.detecting = false;
+    if(!detecting())
+    {
+      updateAddresses();
+    }
+  }
+}
+
+static bool process(Chain& chain, uint32_t& scanStart)
+{
+  if(chain.scanCount == chain.scanCountProcessed)
+  {
+    return false; // no new scan completed
+  }
+
+  std::array<uint32_t, wordCountMax> values;
+  uint16_t inputCount;
+  {
+    const uint32_t status = save_and_disable_interrupts();
+    values = chain.buffers[chain.scanBuffer ^ 1];
+    scanStart = chain.scanStart[chain.scanBuffer ^ 1];
+    inputCount = chain.scanInputCount[chain.scanBuffer ^ 1];
+    chain.scanCountProcessed = chain.scanCount;
+    restore_interrupts(status);
+  }
+
+  if(inputCount != chain.inputCount) /*[[unlikely]]*/
+  {
+    return false; // started before the input count changed, e.g. the scan after auto detection
+  }
+
+  const uint wordCount = (chain.inputCount + wordSize - 1) / wordSize;
+  if(const uint bitsInLastWord = chain.inputCount % wordSize; bitsInLastWord != 0)
+  {
+    // values are shifted in form the right, align them left
+    values[wordCount - 1] >>= wordSize - bitsInLastWord;
+  }
+
+  if(chain.detecting)
+  {
+    detect(chain, values);
+    return false;
+  }
+
+  if(detecting())
+  {
+    return false; // addresses are known when all chains are detected
+  }
+
+  uint16_t inputIndex = 0;
+  for(uint i = 0; i < wordCount; ++i)
+  {
+    const uint bitsToRead = std::min<uint>(chain.inputCount - inputIndex, wordSize);
+    TraintasticCS::Input::updateStates(TraintasticCS::InputChannel::S88, chain.firstAddress + inputIndex, values[i], bitsToRead, scanStart);
+    inputIndex += bitsToRead;
+  }
+
+  return true;
+}
+
+static void startScheduledScans()
+{
+  const auto now = get_absolute_time();
+  if(now < g_nextScan)
   {
     return;
   }
 
-  if(get_absolute_time() < g_nextScan)
+  for(auto& chain : g_chains)
+  {
+    if(chain.enabled && !chain.scanActive) // an overrunning scan just skips this interval
+    {
+      startScan(chain);
+    }
+  }
+
+  g_nextScan = delayed_by_us(g_nextScan, g_scanInterval);
+  if(g_nextScan < now) // fell behind, don't try to catch up
+  {
+    g_nextScan = delayed_by_us(now, g_scanInterval);
+  }
+}
+
+static void updateScansPerSecond()
+{
+  const auto now = get_absolute_time();
+  if(now < g_nextSecond)
   {
     return;
   }
+  g_nextSecond = delayed_by_ms(g_nextSecond, 1000);
 
-  constexpr uint wordSize = 32;
+  for(auto& chain : g_chains)
+  {
+    const uint32_t scanCount = chain.scanCount;
+    chain.scansPerSecond = scanCount - chain.scanCountSecond;
+    chain.scanCountSecond = scanCount;
+  }
+}
 
-  while(g_fifoRead != 0 && !pio_sm_is_rx_fifo_empty(S88_PIO, S88_SM))
+void process()
+{
+  if(!g_enabled)
   {
-    auto value = pio_sm_get(S88_PIO, S88_SM);
-    uint bitsToRead = std::min(g_inputCount - g_inputIndex, wordSize);
+    return;
+  }
 
-    if(bitsToRead < wordSize)
+  if(!g_scanning)
+  {
+    if(get_absolute_time() < g_nextScan)
     {
-      // values are shifted in form the right, align them left
-      value >>= wordSize - bitsToRead;
+      return;
     }
+    // from now on scanning is free running, with a zero scan interval the next scan of a chain is started by its DMA IRQ:
+    g_scanning = true;
+    g_nextScan = get_absolute_time();
+    g_nextSecond = make_timeout_time_ms(1000);
+  }
 
-    for(;bitsToRead != 0; --bitsToRead)
+  if(g_scanInterval != 0)
+  {
+    startScheduledScans();
+  }
+  else
+  {
+    for(auto& chain : g_chains)
     {
-      TraintasticCS::Input::updateState(
-        TraintasticCS::InputChannel::S88,
-        1 + g_inputIndex,
-        (value & 1) ? TraintasticCS::InputState::High : TraintasticCS::InputState::Low);
-      value >>= 1;
-      g_inputIndex++;
+      if(chain.enabled && !chain.scanActive) // e.g. after switching from interval to back-to-back
+      {
+        startScan(chain);
+      }
     }
+  }
+
+  updateScansPerSecond();
+
+  std::array<uint32_t, std::size(g_chains)> scanStarts;
+  std::array<bool, std::size(g_chains)> processed;
+
+  TraintasticCS::Input::beginUpdate(TraintasticCS::InputChannel::S88);
 
-    g_fifoRead--;
+  for(size_t i = 0; i < std::size(g_chains); ++i)
+  {
+    processed[i] = g_chains[i].enabled && process(g_chains[i], scanStarts[i]);
   }
 
-  if(g_fifoRead == 0) // trigger next scan
+  TraintasticCS::Input::endUpdate(TraintasticCS::InputChannel::S88);
+
+  // scan-to-report latency, from load pulse until the changes are queued for the host:
+  const uint32_t now = time_us_32();
+  for(size_t i = 0; i < std::size(g_chains); ++i)
   {
-    pio_sm_put(S88_PIO, S88_SM, g_inputCount - 2);
-    g_fifoRead = 1 + (g_inputCount / wordSize); // round up, at multiple of wordSize there is a dummy push
-    g_inputIndex = 0;
+    if(processed[i])
+    {
+      const uint32_t latency = now - scanStarts[i];
+      g_latencySum += latency;
+      g_latencyCount++;
+      g_latencyMax = std::max(g_latencyMax, latency);
+    }
   }
 }
 
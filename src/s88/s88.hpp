@@ -26,14 +26,31 @@
 
 namespace S88 {
 
+constexpr uint8_t moduleCountAutoDetect = 0;
 constexpr uint8_t moduleCountMin = 1;
-constexpr uint8_t moduleCountMax = 16;
+constexpr uint8_t moduleCountMax = 16; // per chain
+constexpr uint8_t chainCountMax = 4;
+constexpr uint16_t inputCountMax = 8 * moduleCountMax * chainCountMax;
 constexpr uint8_t clockFrequencyMin = 1; // kHz
 constexpr uint8_t clockFrequencyMax = 250; // kHz
 
+struct Statistics
+{
+  uint32_t scanInterval; // us, zero is back-to-back
+  uint32_t scansPerSecond; // slowest chain
+  uint32_t scanDuration; // us, slowest chain
+  uint32_t latencyAverage; // us, from load pulse until changes are reported
+  uint32_t latencyMax; // us, since enable
+};
+
 void init();
+uint8_t chainCount();
 bool enabled();
-void enable(uint8_t moduleCount, uint8_t clockFrequency);
+bool detecting();
+uint8_t moduleCount(uint8_t chain);
+void enable(const uint8_t* moduleCounts, uint8_t chainCount, uint8_t clockFrequency);
+void setScanInterval(uint16_t interval); // ms, zero is back-to-back
+Statistics getStatistics();
 void disable();
 void process();
 
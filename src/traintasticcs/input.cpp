@@ -22,6 +22,8 @@
 #include "input.hpp"
 #include <algorithm>
 #include <array>
+#include <pico/time.h>
+#include "inputfilter.hpp"
 #include "messages.hpp"
 #include "../s88/s88.hpp"
 
@@ -29,27 +31,75 @@ namespace TraintasticCS { void send(const Message& message); } // FIXME
 
 namespace TraintasticCS::Input {
 
-static std::array<InputState, 8 * S88::moduleCountMax> g_s88;
+template<uint16_t N>
+struct Store
+{
+  std::array<uint32_t, (N + 31) / 32> known; //!< bit set if state is known
+  std::array<uint32_t, (N + 31) / 32> values; //!< bit set if state is high
+};
+
+static Store<S88::inputCountMax> g_s88;
+
+struct Update
+{
+  static constexpr uint8_t changesMax = 16; //!< above this, bulk is always smaller
+
+  InputChannel channel;
+  bool active = false;
+  uint16_t addressMin;
+  uint16_t addressMax;
+  uint16_t changeCount;
+  std::array<uint16_t, changesMax> changes;
+};
+
+static Update g_update;
+static bool g_timestamps = false;
+static uint32_t g_s88ChangeCount = 0;
 
 struct InputStates
 {
-  InputState* data;
-  size_t size = 0;
+  uint32_t* known;
+  uint32_t* values;
+  uint16_t size = 0;
+
+  InputState operator[](uint16_t index) const
+  {
+    const uint32_t bit = 1u << (index % 32);
+    if((known[index / 32] & bit) == 0)
+    {
+      return InputState::Unknown;
+    }
+    return (values[index / 32] & bit) ? InputState::High : InputState::Low;
+  }
 };
 
+template<uint16_t N>
+static constexpr InputStates toInputStates(Store<N>& store)
+{
+  return {store.known.data(), store.values.data(), N};
+}
+
 static InputStates getStates(InputChannel channel)
 {
   switch(channel)
   {
     case InputChannel::S88:
-      return {g_s88.data(), g_s88.size()};
+      return toInputStates(g_s88);
   }
-  return {nullptr, 0};
+  return {nullptr, nullptr, 0};
 }
 
 void enable()
 {
-  std::fill(g_s88.begin(), g_s88.end(), InputState::Unknown);
+  g_s88.known.fill(0);
+  g_s88.values.fill(0);
+  g_update.active = false;
+  g_timestamps = false;
+}
+
+void setTimestamps(bool enabled)
+{
+  g_timestamps = enabled;
 }
 
 bool getState(InputChannel channel, uint16_t address, InputState& state)
@@ -58,21 +108,232 @@ bool getState(InputChannel channel, uint16_t address, InputState& state)
 
   if(address >= 1 && address <= states.size) /*[[likely]]*/
   {
-    state = states.data[address - 1];
+    state = states[address - 1];
     return true;
   }
 
   return false;
 }
 
-void updateState(InputChannel channel, uint16_t address, InputState state)
+uint32_t changeCount(InputChannel channel)
+{
+  switch(channel)
+  {
+    case InputChannel::S88:
+      return g_s88ChangeCount;
+  }
+  return 0;
+}
+
+bool getStates(InputChannel channel, uint16_t address, uint8_t count, uint32_t& values)
+{
+  const auto states = getStates(channel);
+
+  if(address < 1 || count < 1 || count > 32 || address - 1u + count > states.size)
+  {
+    return false;
+  }
+
+  const uint16_t index = address - 1;
+  const uint8_t shift = index % 32;
+  const uint32_t mask = (count == 32) ? UINT32_MAX : ((1u << count) - 1);
+  values = (states.values[index / 32] & states.known[index / 32]) >> shift;
+  if(shift != 0 && count > 32 - shift) // spans two words
+  {
+    values |= (states.values[index / 32 + 1] & states.known[index / 32 + 1]) << (32 - shift);
+  }
+  values &= mask;
+  return true;
+}
+
+static void changed(InputChannel channel, const InputStates& states, uint16_t address, uint32_t timestamp)
+{
+  if(channel == InputChannel::S88)
+  {
+    g_s88ChangeCount++;
+  }
+
+  if(g_timestamps)
+  {
+    send(InputStateChangedTimestamp(channel, address, states[address - 1], timestamp));
+  }
+  else if(g_update.active && g_update.channel == channel)
+  {
+    if(g_update.changeCount < Update::changesMax)
+    {
+      g_update.changes[g_update.changeCount] = address;
+    }
+    g_update.changeCount++;
+    g_update.addressMin = std::min(g_update.addressMin, address);
+    g_update.addressMax = std::max(g_update.addressMax, address);
+  }
+  else
+  {
+    send(InputStateChanged(channel, address, states[address - 1]));
+  }
+}
+
+static void updateWord(InputChannel channel, const InputStates& states, uint16_t index, uint32_t values, uint32_t mask, uint32_t timestamp)
+{
+  values = InputFilter::apply(channel, index, values, mask);
+
+  uint32_t diff = ((states.values[index] ^ values) | ~states.known[index]) & mask;
+  if(diff == 0) /*[[likely]]*/
+  {
+    return;
+  }
+
+  states.values[index] = (states.values[index] & ~mask) | values;
+  states.known[index] |= mask;
+
+  // only visit the changed bits:
+  while(diff != 0)
+  {
+    const uint8_t bit = __builtin_ctz(diff);
+    diff &= diff - 1;
+    changed(channel, states, 1 + index * 32 + bit, timestamp);
+  }
+}
+
+void updateStates(InputChannel channel, uint16_t address, uint32_t values, uint8_t count, uint32_t timestamp)
 {
   auto states = getStates(channel);
 
-  if(address >= 1 && address <= states.size && states.data[address - 1] != state)
+  if(address < 1 || count < 1 || count > 32 || address - 1u + count > states.size)
+  {
+    return;
+  }
+
+  const uint16_t index = address - 1;
+  const uint8_t shift = index % 32;
+  const uint32_t mask = (count == 32) ? UINT32_MAX : ((1u << count) - 1);
+  values &= mask;
+
+  updateWord(channel, states, index / 32, values << shift, mask << shift, timestamp);
+  if(shift != 0 && count > 32 - shift) // spans two words
+  {
+    updateWord(channel, states, index / 32 + 1, values >> (32 - shift), mask >> (32 - shift), timestamp);
+  }
+}
+
+bool sendStates(InputChannel channel, uint16_t address, uint16_t count)
+{
+  const auto states = getStates(channel);
+
+  if(address < 1 || count < 1 || count > TraintasticCS::InputStates::countMax || address - 1u + count > states.size)
+  {
+    return false;
+  }
+
+  uint8_t buffer[sizeof(Message) + 255 + sizeof(Checksum)];
+  auto* message = reinterpret_cast<TraintasticCS::InputStates*>(buffer);
+  message->command = Command::InputStates;
+  message->length = 5 + (count + 3) / 4;
+  message->channel = channel;
+  message->setStartAddress(address);
+  message->setCount(count);
+  std::fill_n(message->states, (count + 3) / 4, 0);
+  for(uint16_t i = 0; i < count; ++i)
+  {
+    message->states[i / 4] |= static_cast<uint8_t>(states[address - 1 + i]) << (2 * (i % 4));
+  }
+  updateChecksum(*message);
+  send(*message);
+  return true;
+}
+
+void beginUpdate(InputChannel channel)
+{
+  g_update.channel = channel;
+  g_update.active = true;
+  g_update.addressMin = UINT16_MAX;
+  g_update.addressMax = 0;
+  g_update.changeCount = 0;
+}
+
+//! All inputs in the range must be known
+static void sendBulkKnown(InputChannel channel, uint16_t address, uint16_t count)
+{
+  const auto states = getStates(channel);
+  uint8_t buffer[sizeof(Message) + 255 + sizeof(Checksum)];
+  auto* message = reinterpret_cast<InputStatesBulk*>(buffer);
+
+  while(count != 0)
+  {
+    const uint16_t n = std::min(count, InputStatesBulk::countMax);
+
+    message->command = Command::InputStatesBulk;
+    message->length = 5 + (n + 7) / 8;
+    message->channel = channel;
+    message->setStartAddress(address);
+    message->setCount(n);
+    std::fill_n(message->states, (n + 7) / 8, 0);
+    for(uint16_t i = 0; i < n; ++i)
+    {
+      if(states[address - 1 + i] == InputState::High)
+      {
+        message->states[i / 8] |= 1 << (i % 8);
+      }
+    }
+    updateChecksum(*message);
+    send(*message);
+
+    address += n;
+    count -= n;
+  }
+}
+
+static void sendBulk(InputChannel channel, uint16_t address, uint16_t count)
+{
+  // the bulk format has no unknown state, only send runs of known inputs:
+  const auto states = getStates(channel);
+  const uint16_t end = address + count;
+  while(address < end)
+  {
+    while(address < end && states[address - 1] == InputState::Unknown)
+    {
+      address++;
+    }
+    uint16_t runEnd = address;
+    while(runEnd < end && states[runEnd - 1] != InputState::Unknown)
+    {
+      runEnd++;
+    }
+    if(runEnd > address)
+    {
+      sendBulkKnown(channel, address, runEnd - address);
+    }
+    address = runEnd;
+  }
+}
+
+void endUpdate(InputChannel channel)
+{
+  if(!g_update.active || g_update.channel != channel)
+  {
+    return;
+  }
+  g_update.active = false;
+
+  if(g_update.changeCount == 0)
+  {
+    return;
+  }
+
+  const uint16_t count = g_update.addressMax - g_update.addressMin + 1;
+  const uint16_t bulkSize = sizeof(Message) + 5 + (count + 7) / 8 + sizeof(Checksum);
+  if(g_update.changeCount > Update::changesMax || bulkSize < g_update.changeCount * sizeof(InputStateChanged))
+  {
+    sendBulk(channel, g_update.addressMin, count);
+  }
+  else
   {
-    states.data[address - 1] = state;
-    send(InputStateChanged(channel, address, state));
+    const auto states = getStates(channel);
+    for(uint16_t i = 0; i < g_update.changeCount; ++i)
+    {
+      const uint16_t address = g_update.changes[i];
+      send(InputStateChanged(channel, address, states[address - 1]));
+    }
   }
 }
 
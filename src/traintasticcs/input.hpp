@@ -28,9 +28,46 @@ namespace TraintasticCS::Input {
 
 void enable();
 
+/**
+ * When enabled, changes are reported as InputStateChangedTimestamp message
+ * and never as InputStatesBulk message.
+ */
+void setTimestamps(bool enabled);
+
 bool getState(InputChannel channel, uint16_t address, InputState& state);
 
-void updateState(InputChannel channel, uint16_t address, InputState state);
+/**
+ * Get the states of \p count (max. 32) consecutive inputs starting at \p address.
+ * Bit 0 of \p values is the input at \p address, 0=Low or Unknown, 1=High.
+ * \return \c false if the range is invalid.
+ */
+bool getStates(InputChannel channel, uint16_t address, uint8_t count, uint32_t& values);
+
+/**
+ * Number of state changes of a channel, for detecting changes by polling.
+ */
+uint32_t changeCount(InputChannel channel);
+
+/**
+ * Update the state of \p count (max. 32) consecutive inputs starting at \p address.
+ * Bit 0 of \p values is the input at \p address, 0=Low, 1=High.
+ * \p timestamp is the time_us_32() value at which the inputs were sampled.
+ */
+void updateStates(InputChannel channel, uint16_t address, uint32_t values, uint8_t count, uint32_t timestamp);
+
+/**
+ * Send the current states of a range of inputs as InputStates message.
+ * \return \c false if the range is invalid, nothing is sent.
+ */
+bool sendStates(InputChannel channel, uint16_t address, uint16_t count);
+
+/**
+ * All state changes between beginUpdate and endUpdate are reported to the
+ * host at endUpdate, either as InputStateChanged or as InputStatesBulk
+ * message(s), whichever results in the least number of bytes.
+ */
+void beginUpdate(InputChannel channel);
+void endUpdate(InputChannel channel);
 
 }
 
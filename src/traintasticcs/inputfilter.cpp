@@ -0,0 +1,262 @@
+/**
+ * This file is part of the Traintastic CS firmware,
+ * see <https://github.com/traintastic/traintastic-cs-firmware>.
+ *
+ * Copyright (C) 2024 Reinder Feenstra
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "inputfilter.hpp"
+#include <array>
+#include <cstddef>
+#include "../s88/s88.hpp"
+
+namespace TraintasticCS::InputFilter {
+
+static constexpr uint8_t counterBits = 8; // must be able to hold delayMax - 1
+static constexpr uint8_t windowCountBits = 4; // must be able to hold windowMax
+
+/**
+ * Filter state and settings of 32 inputs, stored bit-sliced: every array
+ * element is one bit plane, bit n of each plane belongs to input n.
+ */
+struct Word
+{
+  uint32_t initialized; //!< input has been sampled at least once
+  uint32_t state; //!< filtered state
+  uint32_t window; //!< input uses N-of-M filter instead of delay filter
+
+  // delay filter:
+  std::array<uint32_t, counterBits> counter; //!< consecutive samples that differ from state
+  std::array<uint32_t, counterBits> onDelay; //!< samples - 1 before changing to high
+  std::array<uint32_t, counterBits> offDelay; //!< samples - 1 before changing to low
+
+  // N-of-M filter:
+  std::array<uint32_t, windowMax> history; //!< history[0] is the last sample
+  std::array<uint32_t, windowMax> windowMask; //!< plane k is set if M > k
+  std::array<uint32_t, windowCountBits> n;
+};
+
+static std::array<Word, (S88::inputCountMax + 31) / 32> g_s88;
+
+struct Words
+{
+  Word* data;
+  uint16_t size;
+};
+
+static Words getWords(InputChannel channel)
+{
+  switch(channel)
+  {
+    case InputChannel::S88:
+      return {g_s88.data(), S88::inputCountMax};
+  }
+  return {nullptr, 0};
+}
+
+template<std::size_t N>
+static inline void setPlanes(std::array<uint32_t, N>& planes, uint32_t bit, uint16_t value)
+{
+  for(std::size_t i = 0; i < N; ++i)
+  {
+    if(value & (1u << i))
+    {
+      planes[i] |= bit;
+    }
+    else
+    {
+      planes[i] &= ~bit;
+    }
+  }
+}
+
+//! Bit-sliced a >= b
+template<std::size_t N>
+static inline uint32_t greaterOrEqual(const std::array<uint32_t, N>& a, const std::array<uint32_t, N>& b)
+{
+  uint32_t borrow = 0;
+  for(std::size_t i = 0; i < N; ++i)
+  {
+    borrow = (~a[i] & b[i]) | (~(a[i] ^ b[i]) & borrow);
+  }
+  return ~borrow;
+}
+
+//! Bit-sliced count += 1 for bits in mask
+template<std::size_t N>
+static inline void increment(std::array<uint32_t, N>& count, uint32_t mask)
+{
+  uint32_t carry = mask;
+  for(std::size_t i = 0; i < N && carry != 0; ++i)
+  {
+    const uint32_t c = count[i] & carry;
+    count[i] ^= carry;
+    carry = c;
+  }
+}
+
+void reset()
+{
+  for(auto& word : g_s88)
+  {
+    word = Word();
+  }
+}
+
+bool set(InputChannel channel, uint16_t address, uint16_t count, InputFilterType type, uint8_t param1, uint8_t param2)
+{
+  const auto words = getWords(channel);
+
+  if(address < 1 || count < 1 || address - 1u + count > words.size)
+  {
+    return false;
+  }
+
+  switch(type)
+  {
+    case InputFilterType::None:
+      param1 = 1;
+      param2 = 1;
+      [[fallthrough]];
+
+    case InputFilterType::Delay: // param1 = on delay, param2 = off delay
+      if(param1 < 1 || param1 > delayMax || param2 < 1 || param2 > delayMax)
+      {
+        return false;
+      }
+      break;
+
+    case InputFilterType::NOfM: // param1 = N, param2 = M
+      if(param2 < 1 || param2 > windowMax || 2 * param1 <= param2 || param1 > param2)
+      {
+        return false;
+      }
+      break;
+
+    default:
+      return false;
+  }
+
+  for(uint16_t index = address - 1; index < address - 1 + count; ++index)
+  {
+    auto& word = words.data[index / 32];
+    const uint32_t bit = 1u << (index % 32);
+
+    word.initialized &= ~bit; // restart filter
+    if(type == InputFilterType::NOfM)
+    {
+      word.window |= bit;
+      setPlanes(word.n, bit, param1);
+      for(uint8_t k = 0; k < windowMax; ++k)
+      {
+        if(k < param2)
+        {
+          word.windowMask[k] |= bit;
+        }
+        else
+        {
+          word.windowMask[k] &= ~bit;
+        }
+      }
+    }
+    else
+    {
+      word.window &= ~bit;
+      setPlanes(word.onDelay, bit, param1 - 1);
+      setPlanes(word.offDelay, bit, param2 - 1);
+    }
+  }
+
+  return true;
+}
+
+uint32_t apply(InputChannel channel, uint16_t index, uint32_t values, uint32_t mask)
+{
+  const auto words = getWords(channel);
+  if(index >= (words.size + 31) / 32) /*[[unlikely]]*/
+  {
+    return values;
+  }
+  auto& word = words.data[index];
+  const uint32_t sampled = mask;
+
+  // first sample, take it as is:
+  if(const uint32_t first = mask & ~word.initialized; first != 0) /*[[unlikely]]*/
+  {
+    word.initialized |= first;
+    word.state = (word.state & ~first) | (values & first);
+    for(auto& plane : word.counter)
+    {
+      plane &= ~first;
+    }
+    for(auto& plane : word.history)
+    {
+      plane = (plane & ~first) | (values & first);
+    }
+    mask &= ~first;
+  }
+
+  // delay filter, change state after the input differs for the configured number of consecutive samples:
+  {
+    const uint32_t diff = (values ^ word.state) & mask & ~word.window;
+    const uint32_t keep = ~mask | word.window;
+
+    uint32_t equal = UINT32_MAX; // counter == delay
+    for(uint8_t i = 0; i < counterBits; ++i)
+    {
+      const uint32_t delay = (word.state & word.offDelay[i]) | (~word.state & word.onDelay[i]);
+      equal &= ~(word.counter[i] ^ delay);
+    }
+
+    const uint32_t flip = diff & equal;
+    const uint32_t count = diff & ~flip;
+    word.state ^= flip;
+
+    // counter = count ? counter + 1 : 0
+    increment(word.counter, count);
+    for(auto& plane : word.counter)
+    {
+      plane &= count | keep;
+    }
+  }
+
+  // N-of-M filter, change state if at least N of the last M samples are equal:
+  if(const uint32_t window = word.window & mask; window != 0)
+  {
+    for(uint8_t k = windowMax - 1; k > 0; --k)
+    {
+      word.history[k] = (word.history[k] & ~window) | (word.history[k - 1] & window);
+    }
+    word.history[0] = (word.history[0] & ~window) | (values & window);
+
+    std::array<uint32_t, windowCountBits> high{};
+    std::array<uint32_t, windowCountBits> low{};
+    for(uint8_t k = 0; k < windowMax; ++k)
+    {
+      increment(high, word.history[k] & word.windowMask[k]);
+      increment(low, ~word.history[k] & word.windowMask[k]);
+    }
+
+    const uint32_t toHigh = greaterOrEqual(high, word.n) & window;
+    const uint32_t toLow = greaterOrEqual(low, word.n) & window;
+    word.state = (word.state | toHigh) & ~toLow;
+  }
+
+  return word.state & sampled;
+}
+
+}
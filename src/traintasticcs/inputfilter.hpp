@@ -0,0 +1,54 @@
+/**
+ * This file is part of the Traintastic CS firmware,
+ * see <https://github.com/traintastic/traintastic-cs-firmware>.
+ *
+ * Copyright (C) 2024 Reinder Feenstra
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINTASTICCS_INPUTFILTER_HPP
+#define TRAINTASTICCS_INPUTFILTER_HPP
+
+#include "types.hpp"
+
+namespace TraintasticCS::InputFilter {
+
+constexpr uint8_t delayMax = 255; // samples
+constexpr uint8_t windowMax = 8; // samples
+
+/**
+ * Reset filter settings and state of all inputs, filter type is None.
+ */
+void reset();
+
+/**
+ * Set the filter of a range of inputs.
+ * \return \c false if the range or filter parameters are invalid.
+ */
+bool set(InputChannel channel, uint16_t address, uint16_t count, InputFilterType type, uint8_t param1, uint8_t param2);
+
+/**
+ * Feed a new sample of 32 inputs to the filter, all inputs are processed in parallel (bit-sliced).
+ * \param[in] index Word index, input address = 1 + 32 * index + bit.
+ * \param[in] values Raw input values, 0=Low, 1=High.
+ * \param[in] mask Inputs that are sampled.
+ * \return Filtered input values, only bits in \p mask are valid.
+ */
+uint32_t apply(InputChannel channel, uint16_t index, uint32_t values, uint32_t mask);
+
+}
+
+#endif
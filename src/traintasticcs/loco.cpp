@@ -0,0 +1,104 @@
+/**
+ * This file is part of the Traintastic CS firmware,
+ * see <https://github.com/traintastic/traintastic-cs-firmware>.
+ *
+ * Copyright (C) 2024 Reinder Feenstra
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "loco.hpp"
+
+namespace TraintasticCS::Loco {
+
+static constexpr uint8_t locoCountMax = 32;
+
+static std::array<State, locoCountMax> g_locos;
+static uint32_t g_useCounter = 0;
+
+uint8_t State::updateFunctions(uint8_t base, uint8_t mask, uint8_t values)
+{
+  uint8_t changed = 0;
+  for(uint8_t i = 0; i < 8 && base + i < functionCount; ++i)
+  {
+    const uint32_t bit = 1u << ((base + i) % 32);
+    const uint8_t index = (base + i) / 32;
+    if((mask & (1 << i)) == 0)
+    {
+      continue;
+    }
+    const bool value = values & (1 << i);
+    if((functionsKnown[index] & bit) == 0 || ((functions[index] & bit) != 0) != value)
+    {
+      changed |= 1 << i;
+      functionsKnown[index] |= bit;
+      if(value)
+      {
+        functions[index] |= bit;
+      }
+      else
+      {
+        functions[index] &= ~bit;
+      }
+    }
+  }
+  return changed;
+}
+
+void clear()
+{
+  for(auto& loco : g_locos)
+  {
+    loco.used = false;
+  }
+}
+
+State& get(uint16_t address)
+{
+  State* lru = &g_locos[0];
+  for(auto& loco : g_locos)
+  {
+    if(loco.used && loco.address == address)
+    {
+      loco.lastUsed = ++g_useCounter;
+      return loco;
+    }
+    if(!loco.used || (lru->used && loco.lastUsed < lru->lastUsed))
+    {
+      lru = &loco;
+    }
+  }
+
+  // not found, replace least recently used or unused entry:
+  *lru = State();
+  lru->used = true;
+  lru->address = address;
+  lru->lastUsed = ++g_useCounter;
+  return *lru;
+}
+
+const State* find(uint16_t address)
+{
+  for(const auto& loco : g_locos)
+  {
+    if(loco.used && loco.address == address)
+    {
+      return &loco;
+    }
+  }
+  return nullptr;
+}
+
+}
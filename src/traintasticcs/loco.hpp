@@ -0,0 +1,94 @@
+/**
+ * This file is part of the Traintastic CS firmware,
+ * see <https://github.com/traintastic/traintastic-cs-firmware>.
+ *
+ * Copyright (C) 2024 Reinder Feenstra
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINTASTICCS_LOCO_HPP
+#define TRAINTASTICCS_LOCO_HPP
+
+#include <array>
+#include <cstdint>
+#include "direction.hpp"
+#include "throttle/channel.hpp"
+
+namespace TraintasticCS::Loco {
+
+constexpr uint8_t functionCount = 69; // F0 - F68
+
+struct State
+{
+  bool used = false;
+  uint16_t address = 0; //!< zero is a valid address, e.g. analog locomotive
+  uint32_t lastUsed;
+  bool speedKnown;
+  bool eStop;
+  uint8_t speedStep;
+  uint8_t speedSteps;
+  Direction direction;
+  std::array<uint32_t, (functionCount + 31) / 32> functions;
+  std::array<uint32_t, (functionCount + 31) / 32> functionsKnown;
+  Throttle::Channel ownerChannel; //!< throttle that controlled it last, zero if the host or none
+  uint16_t ownerId;
+
+  bool isOwner(Throttle::Channel channel, uint16_t throttleId) const
+  {
+    return ownerChannel == channel && ownerId == throttleId;
+  }
+
+  void setOwner(Throttle::Channel channel, uint16_t throttleId)
+  {
+    ownerChannel = channel;
+    ownerId = throttleId;
+  }
+
+  //! Controlled by the host or a throttle since it is in the table
+  bool controlled() const
+  {
+    return speedKnown || functionsKnown != decltype(functionsKnown){};
+  }
+
+  bool function(uint8_t number) const
+  {
+    return functions[number / 32] & (1u << (number % 32));
+  }
+
+  /**
+   * Update up to eight functions starting at function number \p base.
+   * \return Mask of functions that changed or were unknown.
+   */
+  uint8_t updateFunctions(uint8_t base, uint8_t mask, uint8_t values);
+};
+
+void clear();
+
+/**
+ * Get the state of a locomotive, if the locomotive isn't in the table yet
+ * the least recently used entry is replaced.
+ */
+State& get(uint16_t address);
+
+/**
+ * Find the state of a locomotive without adding it to the table.
+ * \return Pointer to the state or \c nullptr if the locomotive isn't in the table.
+ */
+const State* find(uint16_t address);
+
+}
+
+#endif
@@ -24,7 +24,9 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <algorithm>
 #include "../utils/byte.hpp"
+#include "direction.hpp"
 #include "types.hpp"
 #include "throttle/channel.hpp"
 
@@ -45,6 +47,16 @@ enum class Command : uint8_t
   GetInfo = 0x02,
   InitXpressNet = 0x03,
   InitS88 = 0x04,
+  GetStatistics = 0x05,
+  SetBaudRate = 0x06,
+  GetInputStates = 0x07,
+  Sequenced = 0x08,
+  SetInputFilter = 0x09,
+  SetS88ScanInterval = 0x0A,
+  TimeSync = 0x0B,
+  SetInputTimestamps = 0x0C,
+  LocoSetSpeedDirection = 0x0D,
+  LocoSetFunctions = 0x0E,
 
   // Traintatic CS -> Traintastic
   ResetOk = FROM_CS | Reset,
@@ -52,9 +64,23 @@ enum class Command : uint8_t
   Info = FROM_CS | GetInfo,
   InitXpressNetOk = FROM_CS | InitXpressNet,
   InitS88Ok = FROM_CS | InitS88,
+  Statistics = FROM_CS | GetStatistics,
+  SetBaudRateOk = FROM_CS | SetBaudRate,
+  InputStates = FROM_CS | GetInputStates,
+  SequencedAck = FROM_CS | Sequenced,
+  SetInputFilterOk = FROM_CS | SetInputFilter,
+  SetS88ScanIntervalOk = FROM_CS | SetS88ScanInterval,
+  Time = FROM_CS | TimeSync,
+  SetInputTimestampsOk = FROM_CS | SetInputTimestamps,
+  LocoSetSpeedDirectionOk = FROM_CS | LocoSetSpeedDirection,
+  LocoSetFunctionsOk = FROM_CS | LocoSetFunctions,
   InputStateChanged = FROM_CS | 0x20,
+  InputStatesBulk = FROM_CS | 0x21,
+  InputStateChangedTimestamp = FROM_CS | 0x22,
   ThrottleSetSpeedDirection = FROM_CS | 0x30,
-  ThrottleSetFunctions = FROM_CS | 0x31,
+  ThrottleSetFunctionMask = FROM_CS | 0x32,
+  AccessorySetOutput = FROM_CS | 0x40,
+  SequencedError = FROM_CS | 0x7E,
   Error = FROM_CS | 0x7F
 };
 #undef FROM_CS
@@ -66,6 +92,8 @@ enum class ErrorCode : uint8_t
   InvalidCommand = 2,
   InvalidCommandPayload = 3,
   AlreadyInitialized = 4,
+  InvalidSequence = 5,
+  Busy = 6,
 };
 
 struct Message
@@ -105,6 +133,7 @@ struct Reset : MessageNoData
   {
   }
 };
+static_assert(sizeof(Reset) == 3);
 
 struct ResetOk : MessageNoData
 {
@@ -113,6 +142,7 @@ struct ResetOk : MessageNoData
   {
   }
 };
+static_assert(sizeof(ResetOk) == 3);
 
 struct Ping : MessageNoData
 {
@@ -121,6 +151,7 @@ struct Ping : MessageNoData
   {
   }
 };
+static_assert(sizeof(Ping) == 3);
 
 struct Pong : MessageNoData
 {
@@ -129,6 +160,7 @@ struct Pong : MessageNoData
   {
   }
 };
+static_assert(sizeof(Pong) == 3);
 
 struct GetInfo : MessageNoData
 {
@@ -137,6 +169,7 @@ struct GetInfo : MessageNoData
   {
   }
 };
+static_assert(sizeof(GetInfo) == 3);
 
 enum class Board : uint8_t
 {
@@ -161,6 +194,7 @@ struct Info : Message
   {
   }
 };
+static_assert(sizeof(Info) == 7);
 
 struct InitXpressNet : MessageNoData
 {
@@ -169,6 +203,7 @@ struct InitXpressNet : MessageNoData
   {
   }
 };
+static_assert(sizeof(InitXpressNet) == 3);
 
 struct InitXpressNetOk : MessageNoData
 {
@@ -177,12 +212,13 @@ struct InitXpressNetOk : MessageNoData
   {
   }
 };
+static_assert(sizeof(InitXpressNetOk) == 3);
 
 struct InitS88 : Message
 {
   uint8_t moduleCount;
   uint8_t clockFrequency;
-  Checksum checksum;
+  Checksum checksum; // or module count of the second chain, see chainCount()
 
   constexpr InitS88(uint8_t moduleCount_, uint8_t clockFrequency_)
     : Message(Command::InitS88, sizeof(InitS88) - sizeof(Message) - sizeof(checksum))
@@ -191,15 +227,111 @@ struct InitS88 : Message
     , checksum{static_cast<Checksum>(static_cast<uint8_t>(command) ^ length ^ moduleCount ^ clockFrequency)}
   {
   }
+
+  uint8_t chainCount() const
+  {
+    return length - 1;
+  }
+
+  //! Module counts of all chains, first one is moduleCount, the others follow clockFrequency
+  void moduleCounts(uint8_t* counts) const
+  {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(this) + sizeof(Message);
+    counts[0] = data[0];
+    std::copy_n(data + 2, chainCount() - 1, counts + 1);
+  }
+};
+static_assert(sizeof(InitS88) == 5);
+
+struct InitS88Ok : Message
+{
+  uint8_t moduleCounts[1]; // one per enabled chain
+
+  uint8_t chainCount() const
+  {
+    return length;
+  }
+};
+static_assert(sizeof(InitS88Ok) == 3);
+
+enum class StatisticsGroup : uint8_t
+{
+  HostLink = 1,
+  Throttle = 2,
+  S88 = 3,
+  Loop = 4,
+  XpressNet = 5,
+  XpressNetDevices = 6,
+  Accessory = 7,
+};
+
+struct GetStatistics : Message
+{
+  StatisticsGroup group;
+  Checksum checksum;
+
+  constexpr GetStatistics(StatisticsGroup group_)
+    : Message(Command::GetStatistics, sizeof(GetStatistics) - sizeof(Message) - sizeof(checksum))
+    , group{group_}
+    , checksum{static_cast<Checksum>(static_cast<uint8_t>(command) ^ length ^ static_cast<uint8_t>(group))}
+  {
+  }
+};
+static_assert(sizeof(GetStatistics) == 4);
+
+struct Statistics : Message
+{
+  StatisticsGroup group;
+  uint8_t values[4]; // 32 bit big endian values
+
+  uint8_t valueCount() const
+  {
+    return (length - sizeof(group)) / 4;
+  }
+
+  uint32_t value(uint8_t index) const
+  {
+    const uint8_t* p = values + 4 * index;
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) | (static_cast<uint32_t>(p[2]) << 8) | p[3];
+  }
+
+  void setValue(uint8_t index, uint32_t value)
+  {
+    uint8_t* p = values + 4 * index;
+    p[0] = static_cast<uint8_t>(value >> 24);
+    p[1] = static_cast<uint8_t>(value >> 16);
+    p[2] = static_cast<uint8_t>(value >> 8);
+    p[3] = static_cast<uint8_t>(value);
+  }
 };
 
-struct InitS88Ok : MessageNoData
+struct SetBaudRate : Message
 {
-  constexpr InitS88Ok()
-    : MessageNoData(Command::InitS88Ok)
+  uint8_t baudRate[4]; // big endian
+  Checksum checksum;
+
+  constexpr SetBaudRate(uint32_t baudRate_)
+    : Message(Command::SetBaudRate, sizeof(SetBaudRate) - sizeof(Message) - sizeof(checksum))
+    , baudRate{static_cast<uint8_t>(baudRate_ >> 24), static_cast<uint8_t>(baudRate_ >> 16), static_cast<uint8_t>(baudRate_ >> 8), static_cast<uint8_t>(baudRate_)}
+    , checksum{static_cast<Checksum>(static_cast<uint8_t>(command) ^ length ^ baudRate[0] ^ baudRate[1] ^ baudRate[2] ^ baudRate[3])}
   {
   }
+
+  uint32_t value() const
+  {
+    return (static_cast<uint32_t>(baudRate[0]) << 24) | (static_cast<uint32_t>(baudRate[1]) << 16) | (static_cast<uint32_t>(baudRate[2]) << 8) | baudRate[3];
+  }
 };
+static_assert(sizeof(SetBaudRate) == 7);
+
+struct SetBaudRateOk : MessageNoData
+{
+  constexpr SetBaudRateOk()
+    : MessageNoData(Command::SetBaudRateOk)
+  {
+  }
+};
+static_assert(sizeof(SetBaudRateOk) == 3);
 
 struct InputStateChanged : Message
 {
@@ -224,6 +356,374 @@ struct InputStateChanged : Message
     return to16(addressL, addressH);
   }
 };
+static_assert(sizeof(InputStateChanged) == 7);
+
+struct InputStateChangedTimestamp : Message
+{
+  InputChannel channel;
+  uint8_t addressH;
+  uint8_t addressL;
+  InputState state;
+  uint8_t timestamp[4]; // big endian
+  Checksum checksum;
+
+  constexpr InputStateChangedTimestamp(InputChannel channel_, uint16_t address_, InputState state_, uint32_t timestamp_)
+    : Message(Command::InputStateChangedTimestamp, sizeof(InputStateChangedTimestamp) - sizeof(Message) - sizeof(checksum))
+    , channel{channel_}
+    , addressH{high8(address_)}
+    , addressL{low8(address_)}
+    , state{state_}
+    , timestamp{static_cast<uint8_t>(timestamp_ >> 24), static_cast<uint8_t>(timestamp_ >> 16), static_cast<uint8_t>(timestamp_ >> 8), static_cast<uint8_t>(timestamp_)}
+    , checksum{static_cast<Checksum>(static_cast<uint8_t>(command) ^ length ^ static_cast<uint8_t>(channel) ^ addressH ^ addressL ^ static_cast<uint8_t>(state) ^ timestamp[0] ^ timestamp[1] ^ timestamp[2] ^ timestamp[3])}
+  {
+  }
+
+  uint16_t address() const
+  {
+    return to16(addressL, addressH);
+  }
+};
+static_assert(sizeof(InputStateChangedTimestamp) == 11);
+
+struct InputStatesBulk : Message
+{
+  static constexpr uint16_t countMax = 8 * (255 - 5);
+
+  InputChannel channel;
+  uint8_t startAddressH;
+  uint8_t startAddressL;
+  uint8_t countH;
+  uint8_t countL;
+  uint8_t states[1]; // bit per input, LSB first, 0=Low, 1=High
+
+  uint16_t startAddress() const
+  {
+    return to16(startAddressL, startAddressH);
+  }
+
+  void setStartAddress(uint16_t value)
+  {
+    startAddressL = low8(value);
+    startAddressH = high8(value);
+  }
+
+  uint16_t count() const
+  {
+    return to16(countL, countH);
+  }
+
+  void setCount(uint16_t value)
+  {
+    countL = low8(value);
+    countH = high8(value);
+  }
+
+  InputState state(uint16_t index) const
+  {
+    return (states[index / 8] & (1 << (index % 8))) ? InputState::High : InputState::Low;
+  }
+};
+
+struct GetInputStates : Message
+{
+  InputChannel channel;
+  uint8_t startAddressH;
+  uint8_t startAddressL;
+  uint8_t countH;
+  uint8_t countL;
+  Checksum checksum;
+
+  constexpr GetInputStates(InputChannel channel_, uint16_t startAddress_, uint16_t count_)
+    : Message(Command::GetInputStates, sizeof(GetInputStates) - sizeof(Message) - sizeof(checksum))
+    , channel{channel_}
+    , startAddressH{high8(startAddress_)}
+    , startAddressL{low8(startAddress_)}
+    , countH{high8(count_)}
+    , countL{low8(count_)}
+    , checksum{static_cast<Checksum>(static_cast<uint8_t>(command) ^ length ^ static_cast<uint8_t>(channel) ^ startAddressH ^ startAddressL ^ countH ^ countL)}
+  {
+  }
+
+  uint16_t startAddress() const
+  {
+    return to16(startAddressL, startAddressH);
+  }
+
+  uint16_t count() const
+  {
+    return to16(countL, countH);
+  }
+};
+static_assert(sizeof(GetInputStates) == 8);
+
+struct InputStates : Message
+{
+  static constexpr uint16_t countMax = 4 * (255 - 5);
+
+  InputChannel channel;
+  uint8_t startAddressH;
+  uint8_t startAddressL;
+  uint8_t countH;
+  uint8_t countL;
+  uint8_t states[1]; // two bits per input, LSB first, see InputState
+
+  uint16_t startAddress() const
+  {
+    return to16(startAddressL, startAddressH);
+  }
+
+  void setStartAddress(uint16_t value)
+  {
+    startAddressL = low8(value);
+    startAddressH = high8(value);
+  }
+
+  uint16_t count() const
+  {
+    return to16(countL, countH);
+  }
+
+  void setCount(uint16_t value)
+  {
+    countL = low8(value);
+    countH = high8(value);
+  }
+
+  InputState state(uint16_t index) const
+  {
+    return static_cast<InputState>((states[index / 4] >> (2 * (index % 4))) & 0x03);
+  }
+};
+
+struct SetInputFilter : Message
+{
+  InputChannel channel;
+  uint8_t startAddressH;
+  uint8_t startAddressL;
+  uint8_t countH;
+  uint8_t countL;
+  InputFilterType type;
+  uint8_t param1;
+  uint8_t param2;
+  Checksum checksum;
+
+  constexpr SetInputFilter(InputChannel channel_, uint16_t startAddress_, uint16_t count_, InputFilterType type_, uint8_t param1_, uint8_t param2_)
+    : Message(Command::SetInputFilter, sizeof(SetInputFilter) - sizeof(Message) - sizeof(checksum))
+    , channel{channel_}
+    , startAddressH{high8(startAddress_)}
+    , startAddressL{low8(startAddress_)}
+    , countH{high8(count_)}
+    , countL{low8(count_)}
+    , type{type_}
+    , param1{param1_}
+    , param2{param2_}
+    , checksum{static_cast<Checksum>(static_cast<uint8_t>(command) ^ length ^ static_cast<uint8_t>(channel) ^ startAddressH ^ startAddressL ^ countH ^ countL ^ static_cast<uint8_t>(type) ^ param1 ^ param2)}
+  {
+  }
+
+  uint16_t startAddress() const
+  {
+    return to16(startAddressL, startAddressH);
+  }
+
+  uint16_t count() const
+  {
+    return to16(countL, countH);
+  }
+};
+static_assert(sizeof(SetInputFilter) == 11);
+
+struct SetInputFilterOk : MessageNoData
+{
+  constexpr SetInputFilterOk()
+    : MessageNoData(Command::SetInputFilterOk)
+  {
+  }
+};
+static_assert(sizeof(SetInputFilterOk) == 3);
+
+struct SetS88ScanInterval : Message
+{
+  uint8_t intervalH;
+  uint8_t intervalL;
+  Checksum checksum;
+
+  constexpr SetS88ScanInterval(uint16_t interval_)
+    : Message(Command::SetS88ScanInterval, sizeof(SetS88ScanInterval) - sizeof(Message) - sizeof(checksum))
+    , intervalH{high8(interval_)}
+    , intervalL{low8(interval_)}
+    , checksum{static_cast<Checksum>(static_cast<uint8_t>(command) ^ length ^ intervalH ^ intervalL)}
+  {
+  }
+
+  uint16_t interval() const
+  {
+    return to16(intervalL, intervalH);
+  }
+};
+static_assert(sizeof(SetS88ScanInterval) == 5);
+
+struct SetS88ScanIntervalOk : MessageNoData
+{
+  constexpr SetS88ScanIntervalOk()
+    : MessageNoData(Command::SetS88ScanIntervalOk)
+  {
+  }
+};
+static_assert(sizeof(SetS88ScanIntervalOk) == 3);
+
+struct TimeSync : MessageNoData
+{
+  constexpr TimeSync()
+    : MessageNoData(Command::TimeSync)
+  {
+  }
+};
+static_assert(sizeof(TimeSync) == 3);
+
+struct Time : Message
+{
+  uint8_t time[4]; // big endian
+  Checksum checksum;
+
+  constexpr Time(uint32_t time_)
+    : Message(Command::Time, sizeof(Time) - sizeof(Message) - sizeof(checksum))
+    , time{static_cast<uint8_t>(time_ >> 24), static_cast<uint8_t>(time_ >> 16), static_cast<uint8_t>(time_ >> 8), static_cast<uint8_t>(time_)}
+    , checksum{static_cast<Checksum>(static_cast<uint8_t>(command) ^ length ^ time[0] ^ time[1] ^ time[2] ^ time[3])}
+  {
+  }
+
+  uint32_t value() const
+  {
+    return (static_cast<uint32_t>(time[0]) << 24) | (static_cast<uint32_t>(time[1]) << 16) | (static_cast<uint32_t>(time[2]) << 8) | time[3];
+  }
+};
+static_assert(sizeof(Time) == 7);
+
+struct SetInputTimestamps : Message
+{
+  uint8_t enabled;
+  Checksum checksum;
+
+  constexpr SetInputTimestamps(bool enabled_)
+    : Message(Command::SetInputTimestamps, sizeof(SetInputTimestamps) - sizeof(Message) - sizeof(checksum))
+    , enabled{enabled_ ? uint8_t(1) : uint8_t(0)}
+    , checksum{static_cast<Checksum>(static_cast<uint8_t>(command) ^ length ^ enabled)}
+  {
+  }
+};
+static_assert(sizeof(SetInputTimestamps) == 4);
+
+struct SetInputTimestampsOk : MessageNoData
+{
+  constexpr SetInputTimestampsOk()
+    : MessageNoData(Command::SetInputTimestampsOk)
+  {
+  }
+};
+static_assert(sizeof(SetInputTimestampsOk) == 3);
+
+struct LocoMessage : Message
+{
+  uint8_t addressH;
+  uint8_t addressL;
+
+  constexpr LocoMessage(Command cmd, uint8_t len, uint16_t address_)
+    : Message(cmd, len)
+    , addressH{high8(address_)}
+    , addressL{low8(address_)}
+  {
+  }
+
+  uint16_t address() const
+  {
+    return to16(addressL, addressH);
+  }
+};
+
+struct LocoSetSpeedDirection : LocoMessage
+{
+  uint8_t direction : 1;
+  uint8_t eStop : 1;
+  uint8_t : 6;
+  uint8_t speedStep;
+  uint8_t speedSteps;
+  Checksum checksum;
+
+  LocoSetSpeedDirection(uint16_t address_, bool eStop_, uint8_t speedStep_, uint8_t speedSteps_, Direction direction_)
+    : LocoMessage(Command::LocoSetSpeedDirection, sizeof(LocoSetSpeedDirection) - sizeof(Message) - sizeof(checksum), address_)
+  {
+    direction = direction_ == Direction::Forward ? 1 : 0;
+    eStop = eStop_ ? 1 : 0;
+    speedStep = speedStep_;
+    speedSteps = speedSteps_;
+    checksum = calcChecksum(*this);
+  }
+};
+static_assert(sizeof(LocoSetSpeedDirection) == 8);
+
+struct LocoSetFunctions : LocoMessage
+{
+  uint8_t base; //!< function number of bit 0
+  uint8_t mask; //!< functions to set
+  uint8_t values; //!< function values, only bits in mask are valid
+  Checksum checksum;
+
+  LocoSetFunctions(uint16_t address_, uint8_t base_, uint8_t mask_, uint8_t values_)
+    : LocoMessage(Command::LocoSetFunctions, sizeof(LocoSetFunctions) - sizeof(Message) - sizeof(checksum), address_)
+    , base{base_}
+    , mask{mask_}
+    , values{values_}
+  {
+    checksum = calcChecksum(*this);
+  }
+};
+static_assert(sizeof(LocoSetFunctions) == 8);
+
+struct LocoSetSpeedDirectionOk : MessageNoData
+{
+  constexpr LocoSetSpeedDirectionOk()
+    : MessageNoData(Command::LocoSetSpeedDirectionOk)
+  {
+  }
+};
+static_assert(sizeof(LocoSetSpeedDirectionOk) == 3);
+
+struct LocoSetFunctionsOk : MessageNoData
+{
+  constexpr LocoSetFunctionsOk()
+    : MessageNoData(Command::LocoSetFunctionsOk)
+  {
+  }
+};
+static_assert(sizeof(LocoSetFunctionsOk) == 3);
+
+struct AccessorySetOutput : Message
+{
+  AccessoryChannel channel;
+  uint8_t addressH;
+  uint8_t addressL;
+  uint8_t output;
+  uint8_t activate;
+  Checksum checksum;
+
+  constexpr AccessorySetOutput(AccessoryChannel channel_, uint16_t address_, uint8_t output_, bool activate_)
+    : Message(Command::AccessorySetOutput, sizeof(AccessorySetOutput) - sizeof(Message) - sizeof(checksum))
+    , channel{channel_}
+    , addressH{high8(address_)}
+    , addressL{low8(address_)}
+    , output{output_}
+    , activate{activate_ ? uint8_t(1) : uint8_t(0)}
+    , checksum{static_cast<Checksum>(static_cast<uint8_t>(command) ^ length ^ static_cast<uint8_t>(channel) ^ addressH ^ addressL ^ output ^ activate)}
+  {
+  }
+
+  uint16_t address() const
+  {
+    return to16(addressL, addressH);
+  }
+};
+static_assert(sizeof(AccessorySetOutput) == 8);
 
 struct ThrottleMessage : Message
 {
@@ -289,25 +789,62 @@ struct ThrottleSetSpeedDirection : ThrottleMessage
 };
 static_assert(sizeof(ThrottleSetSpeedDirection) == 11);
 
-struct ThrottleSetFunctions : ThrottleMessage
+struct ThrottleSetFunctionMask : ThrottleMessage
 {
-  uint8_t functions[1];
+  uint8_t base; //!< function number of bit 0
+  uint8_t mask; //!< functions to set
+  uint8_t values; //!< function values, only bits in mask are valid
+  Checksum checksum;
 
-  uint8_t functionCount() const
+  ThrottleSetFunctionMask(Throttle::Channel channel_, uint16_t throttleId_, uint16_t address_, uint8_t base_, uint8_t mask_, uint8_t values_)
+    : ThrottleMessage(Command::ThrottleSetFunctionMask, sizeof(ThrottleSetFunctionMask) - sizeof(Message) - sizeof(checksum), channel_, throttleId_, address_)
+    , base{base_}
+    , mask{mask_}
+    , values{static_cast<uint8_t>(values_ & mask_)}
   {
-    return length - (sizeof(ThrottleMessage) - sizeof(Message));
+    checksum = calcChecksum(*this);
   }
+};
+static_assert(sizeof(ThrottleSetFunctionMask) == 11);
+
+struct Sequenced : Message
+{
+  Command request;
+  uint8_t sequence;
+  // followed by the request data and checksum
+};
+
+struct SequencedAck : Message
+{
+  uint8_t sequence;
+  Checksum checksum;
 
-  std::pair<uint8_t, bool> function(uint8_t index) const
+  constexpr SequencedAck(uint8_t sequence_)
+    : Message(Command::SequencedAck, sizeof(SequencedAck) - sizeof(Message) - sizeof(checksum))
+    , sequence{sequence_}
+    , checksum{static_cast<Checksum>(static_cast<uint8_t>(command) ^ length ^ sequence)}
   {
-    return {functions[index] & 0x7F, (functions[index] & 0x80) != 0};
   }
+};
+static_assert(sizeof(SequencedAck) == 4);
+
+struct SequencedError : Message
+{
+  uint8_t sequence;
+  Command request;
+  ErrorCode code;
+  Checksum checksum;
 
-  void setFunction(uint8_t index, uint8_t number, bool value)
+  constexpr SequencedError(uint8_t sequence_, Command request_, ErrorCode code_)
+    : Message(Command::SequencedError, sizeof(SequencedError) - sizeof(Message) - sizeof(checksum))
+    , sequence{sequence_}
+    , request{request_}
+    , code{code_}
+    , checksum{static_cast<Checksum>(static_cast<uint8_t>(command) ^ length ^ sequence ^ static_cast<uint8_t>(request) ^ static_cast<uint8_t>(code))}
   {
-    functions[index] = (number & 0x7F) | (value ? 0x80 : 0x00);
   }
 };
+static_assert(sizeof(SequencedError) == 6);
 
 struct Error : Message
 {
@@ -21,11 +21,19 @@
 
 #include "traintasticcs.hpp"
 
+#include <algorithm>
+#include <array>
 #include <cstring>
 #include <pico/stdlib.h>
+#include <hardware/clocks.h>
+#include <hardware/irq.h>
+#include <hardware/sync.h>
 #include <hardware/uart.h>
 
 #include "../config.hpp"
+#include "input.hpp"
+#include "inputfilter.hpp"
+#include "loco.hpp"
 #include "messages.hpp"
 #include "../s88/s88.hpp"
 #include "../xpressnet/xpressnet.hpp"
@@ -35,13 +43,62 @@
   #define DISABLE_COMMUNICATION_TIMEOUT
 #endif
 
-static constexpr uint32_t baudrate = 115'200;
+static constexpr uint32_t baudRateDefault = 115'200;
+static constexpr uint32_t baudRateMax = 3'000'000;
+static constexpr uint32_t baudRateConfirmTimeout = 1'000; // 1 sec
+static constexpr uint32_t baudRateTolerance = 50; // 1/50 = 2%
+static constexpr uint8_t sequenceWindow = 16; // max. number of unacknowledged sequenced commands
 #ifndef DISABLE_COMMUNICATION_TIMEOUT
 static constexpr uint32_t communicationTimeout = 2'000; // 2 sec
 #endif
 
+static constexpr uint16_t rxRingSize = 512; // must be a power of two
+static_assert((rxRingSize & (rxRingSize - 1)) == 0);
+
+static uint8_t g_rxRing[rxRingSize];
+static uint8_t g_rxRingXor[rxRingSize]; // running XOR of all received bytes, used for O(1) checksum validation
+static uint8_t g_rxXor = 0;
+static volatile uint16_t g_rxRingHead = 0; // written by UART IRQ
+static volatile uint16_t g_rxRingTail = 0; // written by process()
+static volatile uint32_t g_rxRingOverflowCount = 0;
 static uint8_t g_rxBuffer[2 + 255 + 1];
-static uint8_t g_rxCount = 0;
+static bool g_rxSynchronized = true;
+static uint32_t g_rxResyncCount = 0;
+static uint32_t g_rxDroppedCount = 0;
+
+static constexpr uint16_t txRingSize = 1024; // must be a power of two
+static_assert((txRingSize & (txRingSize - 1)) == 0);
+static constexpr uint16_t txIndexNone = txRingSize;
+
+static uint8_t g_txRing[txRingSize];
+static volatile uint16_t g_txRingHead = 0; // written by send()
+static volatile uint16_t g_txRingTail = 0; // written by UART IRQ
+static uint16_t g_txRingHighWater = 0;
+static uint32_t g_txRingFullCount = 0;
+static constexpr uint8_t txTimeIndexCountMax = 4; // Time messages waiting to be stamped, besides g_txTimeIndex
+static volatile uint16_t g_txTimeIndex = txIndexNone; // ring index of a Time message, transmission stops there until it's stamped
+static std::array<uint16_t, txTimeIndexCountMax> g_txTimeIndices; // ring indexes of the Time messages queued after g_txTimeIndex
+static uint8_t g_txTimeIndicesHead = 0;
+static uint8_t g_txTimeIndicesCount = 0;
+static volatile uint16_t g_txBaudRateIndex = txIndexNone; // ring index after SetBaudRateOk, transmission stops there until the baudrate is switched
+static uint8_t g_sequenceExpected = 0;
+static int16_t g_sequenceCurrent = -1; // sequence number of the command being executed, -1 if not sequenced
+static bool g_sequenceAckPending = false;
+static bool g_sequenceNakSent = false;
+static uint32_t g_throttleSpeedDirectionCount = 0;
+static uint32_t g_throttleSpeedDirectionSuppressedCount = 0;
+static uint32_t g_throttleFunctionsCount = 0;
+static uint32_t g_throttleFunctionsSuppressedCount = 0;
+static uint32_t g_accessoryCount = 0;
+static uint32_t g_accessoryCoalescedCount = 0;
+static uint32_t g_loopLast = 0; // time_us_32() of previous process() call
+static uint32_t g_loopCount = 0;
+static uint32_t g_loopsPerSecond = 0;
+static uint32_t g_loopTimeMax = 0; // us
+static absolute_time_t g_loopNextSecond = nil_time;
+static uint32_t g_baudRatePending = 0; // applied after SetBaudRateOk is transmitted, see g_txBaudRateIndex
+static bool g_initS88OkPending = false; // sent when S88 module count auto detection is finished
+static absolute_time_t g_baudRateConfirmTimeout = at_the_end_of_time;
 #ifndef DISABLE_COMMUNICATION_TIMEOUT
 static absolute_time_t g_communicationTimeout = at_the_end_of_time;
 #endif
@@ -49,149 +106,826 @@ static absolute_time_t g_communicationTimeout = at_the_end_of_time;
 namespace TraintasticCS
 {
 
+void send(const Message& message);
 static void received();
 
+static void rxDrain()
+{
+  // move all received bytes from the UART FIFO into the ring buffer,
+  // if the ring buffer is full the byte is dropped, the parser will resync.
+  while(uart_is_readable(TRAINTASTIC_CS_UART))
+  {
+    const uint8_t value = uart_getc(TRAINTASTIC_CS_UART);
+    const uint16_t next = (g_rxRingHead + 1) & (rxRingSize - 1);
+    if(next != g_rxRingTail) /*[[likely]]*/
+    {
+      g_rxXor ^= value;
+      g_rxRing[g_rxRingHead] = value;
+      g_rxRingXor[g_rxRingHead] = g_rxXor;
+      g_rxRingHead = next;
+    }
+    else
+    {
+      g_rxRingOverflowCount++;
+    }
+  }
+}
+
+static void txFill()
+{
+  // must be called from UART IRQ or with interrupts disabled
+  while(g_txRingTail != g_txRingHead && g_txRingTail != g_txTimeIndex && g_txRingTail != g_txBaudRateIndex && uart_is_writable(TRAINTASTIC_CS_UART))
+  {
+    uart_putc_raw(TRAINTASTIC_CS_UART, g_txRing[g_txRingTail]);
+    g_txRingTail = (g_txRingTail + 1) & (txRingSize - 1);
+  }
+
+  // only request TX interrupts if there is more data to send, process() continues after a stop:
+  uart_set_irq_enables(TRAINTASTIC_CS_UART, true, g_txRingTail != g_txRingHead && g_txRingTail != g_txTimeIndex && g_txRingTail != g_txBaudRateIndex);
+}
+
+//! All bytes are transmitted, including the stop bit of the last byte
+static bool txIdle()
+{
+  return (uart_get_hw(TRAINTASTIC_CS_UART)->fr & (UART_UARTFR_TXFE_BITS | UART_UARTFR_BUSY_BITS)) == UART_UARTFR_TXFE_BITS;
+}
+
+//! Put the current time in the Time message when it's the next to be transmitted, so queueing delay doesn't add to it
+static void txStampTime()
+{
+  if(g_txTimeIndex == txIndexNone || g_txRingTail != g_txTimeIndex || !txIdle())
+  {
+    return;
+  }
+
+  const uint32_t time = time_us_32();
+  uint8_t checksum = 0;
+  for(uint16_t i = 0; i < sizeof(Time) - sizeof(Checksum); ++i)
+  {
+    const uint16_t index = (g_txTimeIndex + i) & (txRingSize - 1);
+    if(i >= sizeof(Message))
+    {
+      g_txRing[index] = static_cast<uint8_t>(time >> (8 * (sizeof(Time) - sizeof(Checksum) - 1 - i)));
+    }
+    checksum ^= g_txRing[index];
+  }
+  g_txRing[(g_txTimeIndex + sizeof(Time) - sizeof(Checksum)) & (txRingSize - 1)] = checksum;
+
+  uint16_t next = txIndexNone;
+  if(g_txTimeIndicesCount != 0)
+  {
+    next = g_txTimeIndices[g_txTimeIndicesHead];
+    g_txTimeIndicesHead = (g_txTimeIndicesHead + 1) % txTimeIndexCountMax;
+    g_txTimeIndicesCount--;
+  }
+
+  const uint32_t status = save_and_disable_interrupts();
+  g_txTimeIndex = next;
+  txFill();
+  restore_interrupts(status);
+}
+
+static void setBaudRate(uint32_t value);
+
+//! Switch to the new baudrate when SetBaudRateOk has left the UART, frames queued after it are sent at the new baudrate
+static void txSwitchBaudRate()
+{
+  if(g_txBaudRateIndex == txIndexNone || g_txRingTail != g_txBaudRateIndex || !txIdle())
+  {
+    return;
+  }
+
+  if(g_baudRatePending != 0) // not cancelled by a fallback to the default baudrate
+  {
+    // the host must confirm the new baudrate with a ping:
+    setBaudRate(g_baudRatePending);
+    g_baudRateConfirmTimeout = make_timeout_time_ms(baudRateConfirmTimeout);
+  }
+
+  const uint32_t status = save_and_disable_interrupts();
+  g_txBaudRateIndex = txIndexNone;
+  txFill();
+  restore_interrupts(status);
+}
+
+//! Continue transmission if it is stopped by txFill()
+static void txContinue()
+{
+  txStampTime();
+  txSwitchBaudRate();
+}
+
+static void uartIRQ()
+{
+  rxDrain();
+  txFill();
+}
+
 void init()
 {
-  uart_init(TRAINTASTIC_CS_UART, baudrate);
+  uart_init(TRAINTASTIC_CS_UART, baudRateDefault);
   gpio_set_function(TRAINTASTIC_CS_PIN_TX, GPIO_FUNC_UART);
   gpio_set_function(TRAINTASTIC_CS_PIN_RX, GPIO_FUNC_UART);
 
   uart_getc(TRAINTASTIC_CS_UART); // FIXME: why do we receive 0xFF at startup ??
+
+  irq_set_exclusive_handler(TRAINTASTIC_CS_UART_IRQ, uartIRQ);
+  irq_set_enabled(TRAINTASTIC_CS_UART_IRQ, true);
+  uart_set_irq_enables(TRAINTASTIC_CS_UART, true, false);
+}
+
+//! Baudrate the UART runs at when \p value is set, same calculation as uart_set_baudrate()
+static uint32_t actualBaudRate(uint32_t value)
+{
+  const uint32_t div = 8 * clock_get_hz(clk_peri) / value + 1;
+  uint32_t ibrd = div >> 7;
+  uint32_t fbrd = (div & 0x7F) >> 1;
+  if(ibrd == 0)
+  {
+    ibrd = 1;
+    fbrd = 0;
+  }
+  else if(ibrd >= 65535)
+  {
+    ibrd = 65535;
+    fbrd = 0;
+  }
+  return 4 * clock_get_hz(clk_peri) / (64 * ibrd + fbrd);
+}
+
+static bool isBaudRateReachable(uint32_t value, uint32_t actual)
+{
+  const uint32_t error = (actual > value) ? actual - value : value - actual;
+  return error <= value / baudRateTolerance;
+}
+
+static void setBaudRate(uint32_t value)
+{
+  if(!isBaudRateReachable(value, uart_set_baudrate(TRAINTASTIC_CS_UART, value))) /*[[unlikely]]*/
+  {
+    uart_set_baudrate(TRAINTASTIC_CS_UART, baudRateDefault);
+  }
+  g_baudRatePending = 0;
+  g_baudRateConfirmTimeout = at_the_end_of_time;
 }
 
 static void reset()
 {
   S88::disable();
+  S88::setScanInterval(0);
+  g_initS88OkPending = false;
+  g_loopTimeMax = 0;
   XpressNet::disable();
+  Input::enable(); // all states unknown
+  InputFilter::reset();
+  Loco::clear();
+  if(g_sequenceCurrent < 0) // a sequenced reset doesn't restart the sequence numbering
+  {
+    g_sequenceExpected = 0;
+    g_sequenceNakSent = false;
+  }
 #ifndef DISABLE_COMMUNICATION_TIMEOUT
   g_communicationTimeout = at_the_end_of_time;
 #endif
 }
 
+static void sendInitS88Ok()
+{
+  uint8_t buffer[sizeof(Message) + S88::chainCountMax + sizeof(Checksum)];
+  auto* message = reinterpret_cast<InitS88Ok*>(buffer);
+  message->command = Command::InitS88Ok;
+  message->length = 0;
+  while(message->length < S88::chainCount() && S88::moduleCount(message->length) != 0)
+  {
+    message->moduleCounts[message->length] = S88::moduleCount(message->length);
+    message->length++;
+  }
+  updateChecksum(*message);
+  send(*message);
+}
+
+static void measureLoop()
+{
+  // process() is called once per main loop iteration:
+  const uint32_t now = time_us_32();
+  if(g_loopLast != 0) // skip first call, includes initialization
+  {
+    g_loopTimeMax = std::max(g_loopTimeMax, now - g_loopLast);
+  }
+  g_loopLast = now;
+  g_loopCount++;
+
+  if(get_absolute_time() >= g_loopNextSecond)
+  {
+    g_loopNextSecond = make_timeout_time_ms(1000);
+    g_loopsPerSecond = g_loopCount;
+    g_loopCount = 0;
+  }
+}
+
 void process()
 {
-  while(uart_is_readable(TRAINTASTIC_CS_UART))
+  measureLoop();
+
+  for(;;)
   {
-    g_rxBuffer[g_rxCount] = uart_getc(TRAINTASTIC_CS_UART);
-    g_rxCount++;
+    const uint16_t tail = g_rxRingTail;
+    const uint16_t available = (g_rxRingHead - tail) & (rxRingSize - 1);
+    if(available < 2)
+    {
+      break;
+    }
+    const uint16_t size = 2 + g_rxRing[(tail + 1) & (rxRingSize - 1)] + 1;
+    if(available < size)
+    {
+      break;
+    }
 
-    while(g_rxCount >= 2 && g_rxCount == (2 + g_rxBuffer[1] + 1))
+    // XOR of all message bytes including the checksum is zero for a valid message,
+    // using the running XOR that is just two lookups, no matter the message size:
+    const uint16_t last = (tail + size - 1) & (rxRingSize - 1);
+    if((g_rxRingXor[last] ^ g_rxRingXor[(tail - 1) & (rxRingSize - 1)]) == 0) /*[[likely]]*/
     {
-      if(isChecksumValid(*reinterpret_cast<const Message*>(g_rxBuffer))) /*[[likely]]*/
-      {
-        received();
-        g_rxCount = 0;
-        break;
-      }
-      else // drop one byte
+      const uint16_t count = std::min<uint16_t>(size, rxRingSize - tail);
+      std::memcpy(g_rxBuffer, g_rxRing + tail, count);
+      std::memcpy(g_rxBuffer + count, g_rxRing, size - count);
+      g_rxRingTail = (tail + size) & (rxRingSize - 1);
+      g_rxSynchronized = true;
+      received();
+    }
+    else // drop one byte
+    {
+      if(g_rxSynchronized)
       {
-        g_rxCount--;
-        std::memmove(g_rxBuffer, g_rxBuffer + 1, g_rxCount);
+        g_rxSynchronized = false;
+        g_rxResyncCount++;
       }
+      g_rxDroppedCount++;
+      g_rxRingTail = (tail + 1) & (rxRingSize - 1);
     }
   }
 
+  if(g_sequenceAckPending)
+  {
+    // cumulative, acknowledges all sequenced commands up to and including this sequence number:
+    g_sequenceAckPending = false;
+    send(SequencedAck(g_sequenceExpected - 1));
+  }
+
+  if(g_initS88OkPending && !S88::detecting())
+  {
+    g_initS88OkPending = false;
+    sendInitS88Ok();
+  }
+
+  txContinue();
+
+  if(get_absolute_time() >= g_baudRateConfirmTimeout)
+  {
+    // No ping received at the new baudrate -> fallback to default
+    setBaudRate(baudRateDefault);
+  }
+
 #ifndef DISABLE_COMMUNICATION_TIMEOUT
   if(get_absolute_time() >= g_communicationTimeout)
   {
     // No communication from the host -> reset
     reset();
+    setBaudRate(baudRateDefault);
   }
 #endif
 }
 
 void send(const Message& message)
 {
+  const uint16_t size = message.size();
+
+  if(((g_txRingTail - g_txRingHead - 1) & (txRingSize - 1)) < size) /*[[unlikely]]*/
+  {
+    // queue full, wait for the UART IRQ to make room
+    g_txRingFullCount++;
+    while(((g_txRingTail - g_txRingHead - 1) & (txRingSize - 1)) < size)
+    {
+      txContinue(); // transmission might be stopped
+    }
+  }
+
+  uint16_t head = g_txRingHead;
   const auto* p = reinterpret_cast<const uint8_t*>(&message);
-  const uint8_t* end = p + message.size();
+  const uint8_t* end = p + size;
   for(; p < end; ++p)
   {
-    uart_putc_raw(TRAINTASTIC_CS_UART, *p);
+    g_txRing[head] = *p;
+    head = (head + 1) & (txRingSize - 1);
+  }
+  g_txRingHead = head;
+
+  const uint16_t used = (head - g_txRingTail) & (txRingSize - 1);
+  if(used > g_txRingHighWater)
+  {
+    g_txRingHighWater = used;
+  }
+
+  // the TX interrupt only fires when the FIFO level drops, so start by filling the FIFO:
+  const uint32_t status = save_and_disable_interrupts();
+  txFill();
+  restore_interrupts(status);
+}
+
+static void sendStatistics(StatisticsGroup group, const uint32_t* values, uint8_t count)
+{
+  uint8_t buffer[sizeof(Message) + 255 + sizeof(Checksum)];
+  auto* message = reinterpret_cast<Statistics*>(buffer);
+  message->command = Command::Statistics;
+  message->length = sizeof(message->group) + 4 * count;
+  message->group = group;
+  for(uint8_t i = 0; i < count; ++i)
+  {
+    message->setValue(i, values[i]);
   }
+  updateChecksum(*message);
+  send(*message);
+}
+
+static void sendStatistics(StatisticsGroup group, std::initializer_list<uint32_t> values)
+{
+  sendStatistics(group, values.begin(), values.size());
+}
+
+static void sendError(Command request, ErrorCode code)
+{
+  if(g_sequenceCurrent >= 0)
+  {
+    send(SequencedError(g_sequenceCurrent, request, code));
+  }
+  else
+  {
+    send(Error(request, code));
+  }
+}
+
+static void execute(const Message& message);
+
+static void receivedSequenced(Sequenced& message)
+{
+  if(message.length < 2 || message.request == Command::Sequenced)
+  {
+    return send(Error(message.command, ErrorCode::InvalidCommandPayload));
+  }
+
+  if(message.sequence != g_sequenceExpected)
+  {
+    if(static_cast<uint8_t>(g_sequenceExpected - message.sequence) <= sequenceWindow)
+    {
+      // retransmission of an already executed command, just acknowledge it again
+      g_sequenceAckPending = true;
+    }
+    else if(!g_sequenceNakSent)
+    {
+      // command(s) lost, host must retransmit starting at the expected sequence number
+      g_sequenceNakSent = true;
+      send(SequencedError(g_sequenceExpected, message.request, ErrorCode::InvalidSequence));
+    }
+    return;
+  }
+
+  // the request is the sequenced message with its length in place of the sequence number:
+  auto& request = *reinterpret_cast<Message*>(&message.request);
+  request.length = message.length - 2;
+  updateChecksum(request);
+
+  g_sequenceCurrent = message.sequence;
+  g_sequenceExpected++;
+  g_sequenceNakSent = false;
+  g_sequenceAckPending = true;
+  execute(request);
+  g_sequenceCurrent = -1;
 }
 
 static void received()
 {
-  const auto& message = *reinterpret_cast<const Message*>(g_rxBuffer);
+  auto& message = *reinterpret_cast<Message*>(g_rxBuffer);
 
 #ifndef DISABLE_COMMUNICATION_TIMEOUT
   g_communicationTimeout = make_timeout_time_ms(communicationTimeout);
 #endif
 
-  switch(message.command)
+  if(message.command == Command::Sequenced)
   {
-    case Command::Reset:
-      if(message.length != 0)
-      {
-        return send(Error(message.command, ErrorCode::InvalidCommandPayload));
-      }
-      reset();
-      return send(ResetOk());
+    return receivedSequenced(static_cast<Sequenced&>(message));
+  }
 
-    case Command::Ping:
-      if(message.length != 0)
-      {
-        return send(Error(message.command, ErrorCode::InvalidCommandPayload));
-      }
-      return send(Pong());
+  execute(message);
+}
+
+static void handle(const Reset& /*message*/)
+{
+  reset();
+  send(ResetOk());
+}
+
+static void handle(const Ping& /*message*/)
+{
+  g_baudRateConfirmTimeout = at_the_end_of_time; // new baudrate confirmed (if any)
+  send(Pong());
+}
+
+static void handle(const GetInfo& /*message*/)
+{
+  send(Info(Board::TraintasticCS, 0, 1, 0));
+}
+
+static void handle(const InitXpressNet& message)
+{
+  if(XpressNet::enabled())
+  {
+    return sendError(message.command, ErrorCode::AlreadyInitialized);
+  }
+  XpressNet::enable();
+  send(InitXpressNetOk());
+}
+
+static bool validate(const InitS88& message)
+{
+  if(message.chainCount() > S88::chainCount() ||
+      message.clockFrequency < S88::clockFrequencyMin ||
+      message.clockFrequency > S88::clockFrequencyMax)
+  {
+    return false;
+  }
+  uint8_t moduleCounts[S88::chainCountMax];
+  message.moduleCounts(moduleCounts);
+  return std::all_of(moduleCounts, moduleCounts + message.chainCount(),
+    [](uint8_t moduleCount)
+    {
+      return moduleCount == S88::moduleCountAutoDetect || (moduleCount >= S88::moduleCountMin && moduleCount <= S88::moduleCountMax);
+    });
+}
+
+static void handle(const InitS88& message)
+{
+  if(S88::enabled())
+  {
+    return sendError(message.command, ErrorCode::AlreadyInitialized);
+  }
+  uint8_t moduleCounts[S88::chainCountMax];
+  message.moduleCounts(moduleCounts);
+  S88::enable(moduleCounts, message.chainCount(), message.clockFrequency);
+  if(S88::detecting())
+  {
+    g_initS88OkPending = true; // sent by process() when auto detection is finished
+  }
+  else
+  {
+    sendInitS88Ok();
+  }
+}
+
+static void handle(const GetStatistics& message)
+{
+  switch(message.group)
+  {
+    case StatisticsGroup::HostLink:
+      return sendStatistics(message.group, {
+        g_rxRingOverflowCount,
+        txRingSize - 1,
+        g_txRingHighWater,
+        g_txRingFullCount,
+        g_rxResyncCount,
+        g_rxDroppedCount,
+      });
+
+    case StatisticsGroup::Throttle:
+      return sendStatistics(message.group, {
+        g_throttleSpeedDirectionCount,
+        g_throttleSpeedDirectionSuppressedCount,
+        g_throttleFunctionsCount,
+        g_throttleFunctionsSuppressedCount,
+      });
+
+    case StatisticsGroup::S88:
+    {
+      const auto statistics = S88::getStatistics();
+      return sendStatistics(message.group, {
+        statistics.scanInterval / 1000, // ms, same unit as SetS88ScanInterval
+        statistics.scansPerSecond,
+        statistics.scanDuration,
+        statistics.latencyAverage,
+        statistics.latencyMax,
+      });
+    }
+
+    case StatisticsGroup::Loop:
+      return sendStatistics(message.group, {
+        g_loopsPerSecond,
+        g_loopTimeMax,
+      });
+
+    case StatisticsGroup::XpressNet:
+    {
+      const auto statistics = XpressNet::getStatistics();
+      return sendStatistics(message.group, {
+        statistics.rxFramingErrors,
+        statistics.rxOverflows,
+        statistics.txDropped,
+      });
+    }
 
-    case Command::GetInfo:
+    case StatisticsGroup::Accessory:
+      return sendStatistics(message.group, {
+        g_accessoryCount,
+        g_accessoryCoalescedCount,
+      });
+
+    case StatisticsGroup::XpressNetDevices:
     {
-      if(message.length != 0)
+      uint32_t values[2 * XpressNet::addressMax];
+      for(uint8_t address = XpressNet::addressMin; address <= XpressNet::addressMax; ++address)
       {
-        return send(Error(message.command, ErrorCode::InvalidCommandPayload));
+        const auto statistics = XpressNet::getDeviceStatistics(address);
+        values[2 * (address - 1)] = statistics.pollInterval;
+        values[2 * (address - 1) + 1] = statistics.responseCount;
       }
-      return send(Info(Board::TraintasticCS, 0, 1, 0));
+      return sendStatistics(message.group, values, std::size(values));
     }
-    case Command::InitXpressNet:
-      if(message.length != 0)
+  }
+  sendError(message.command, ErrorCode::InvalidCommandPayload);
+}
+
+static bool validate(const SetBaudRate& message)
+{
+  return
+    message.value() >= baudRateDefault &&
+    message.value() <= baudRateMax &&
+    isBaudRateReachable(message.value(), actualBaudRate(message.value()));
+}
+
+static void handle(const SetBaudRate& message)
+{
+  g_baudRatePending = message.value();
+  send(SetBaudRateOk());
+  g_txBaudRateIndex = g_txRingHead; // switched by txSwitchBaudRate()
+}
+
+static void handle(const GetInputStates& message)
+{
+  if(!Input::sendStates(message.channel, message.startAddress(), message.count()))
+  {
+    sendError(message.command, ErrorCode::InvalidCommandPayload);
+  }
+}
+
+static void handle(const SetInputFilter& message)
+{
+  if(!InputFilter::set(message.channel, message.startAddress(), message.count(), message.type, message.param1, message.param2))
+  {
+    return sendError(message.command, ErrorCode::InvalidCommandPayload);
+  }
+  send(SetInputFilterOk());
+}
+
+static void handle(const SetS88ScanInterval& message)
+{
+  S88::setScanInterval(message.interval());
+  send(SetS88ScanIntervalOk());
+}
+
+static void handle(const TimeSync& message)
+{
+  // stamped by txStampTime():
+  if(g_txTimeIndex == txIndexNone)
+  {
+    g_txTimeIndex = g_txRingHead;
+  }
+  else if(g_txTimeIndicesCount < txTimeIndexCountMax)
+  {
+    g_txTimeIndices[(g_txTimeIndicesHead + g_txTimeIndicesCount) % txTimeIndexCountMax] = g_txRingHead;
+    g_txTimeIndicesCount++;
+  }
+  else
+  {
+    return sendError(message.command, ErrorCode::Busy);
+  }
+  send(Time(time_us_32()));
+}
+
+static bool validate(const SetInputTimestamps& message)
+{
+  return message.enabled <= 1;
+}
+
+static void handle(const SetInputTimestamps& message)
+{
+  Input::setTimestamps(message.enabled != 0);
+  send(SetInputTimestampsOk());
+}
+
+static bool validate(const LocoSetSpeedDirection& message)
+{
+  return
+    (message.speedSteps == 14 || message.speedSteps == 27 || message.speedSteps == 28 || message.speedSteps == 126) &&
+    message.speedStep <= message.speedSteps;
+}
+
+static void handle(const LocoSetSpeedDirection& message)
+{
+  auto& loco = Loco::get(message.address());
+  const uint8_t speedStep = message.eStop ? 0 : message.speedStep;
+  const Direction direction = message.direction ? Direction::Forward : Direction::Reverse;
+
+  // an update that matches the cached state is the host confirming a throttle's change, the throttle stays the owner:
+  if(!loco.speedKnown || loco.eStop != message.eStop || loco.speedStep != speedStep || loco.speedSteps != message.speedSteps || loco.direction != direction)
+  {
+    loco.setOwner({}, 0);
+  }
+  loco.speedKnown = true;
+  loco.eStop = message.eStop;
+  loco.speedStep = speedStep;
+  loco.speedSteps = message.speedSteps;
+  loco.direction = direction;
+  send(LocoSetSpeedDirectionOk());
+}
+
+static bool validate(const LocoSetFunctions& message)
+{
+  return message.base < Loco::functionCount;
+}
+
+static void handle(const LocoSetFunctions& message)
+{
+  auto& loco = Loco::get(message.address());
+  if(loco.updateFunctions(message.base, message.mask, message.values) != 0)
+  {
+    loco.setOwner({}, 0);
+  }
+  send(LocoSetFunctionsOk());
+}
+
+template<class T>
+static bool validate(const T& /*message*/)
+{
+  return true; // no payload validation besides length
+}
+
+template<class T>
+static void dispatch(const Message& message)
+{
+  const auto& request = static_cast<const T&>(message);
+  if(!validate(request))
+  {
+    return sendError(message.command, ErrorCode::InvalidCommandPayload);
+  }
+  handle(request);
+}
+
+struct CommandHandler
+{
+  uint8_t lengthMin = 0;
+  uint8_t lengthMax = 0;
+  void (*dispatch)(const Message&) = nullptr;
+};
+
+template<class T>
+constexpr uint8_t payloadLengthMin = sizeof(T) - sizeof(Message) - sizeof(Checksum);
+
+template<class T>
+constexpr uint8_t payloadLengthMax = payloadLengthMin<T>;
+
+template<>
+constexpr uint8_t payloadLengthMax<InitS88> = payloadLengthMin<InitS88> + S88::chainCountMax - 1; // module count per extra chain
+
+template<class T>
+constexpr void add(std::array<CommandHandler, 0x80>& handlers, Command command)
+{
+  static_assert(sizeof(T) - sizeof(Message) - sizeof(Checksum) <= 255);
+  handlers[static_cast<uint8_t>(command)] = {payloadLengthMin<T>, payloadLengthMax<T>, dispatch<T>};
+}
+
+static constexpr auto commandHandlers = []()
+  {
+    std::array<CommandHandler, 0x80> handlers{};
+    add<Reset>(handlers, Command::Reset);
+    add<Ping>(handlers, Command::Ping);
+    add<GetInfo>(handlers, Command::GetInfo);
+    add<InitXpressNet>(handlers, Command::InitXpressNet);
+    add<InitS88>(handlers, Command::InitS88);
+    add<GetStatistics>(handlers, Command::GetStatistics);
+    add<SetBaudRate>(handlers, Command::SetBaudRate);
+    add<GetInputStates>(handlers, Command::GetInputStates);
+    add<SetInputFilter>(handlers, Command::SetInputFilter);
+    add<SetS88ScanInterval>(handlers, Command::SetS88ScanInterval);
+    add<TimeSync>(handlers, Command::TimeSync);
+    add<SetInputTimestamps>(handlers, Command::SetInputTimestamps);
+    add<LocoSetSpeedDirection>(handlers, Command::LocoSetSpeedDirection);
+    add<LocoSetFunctions>(handlers, Command::LocoSetFunctions);
+    return handlers;
+  }();
+
+static void execute(const Message& message)
+{
+  const uint8_t opcode = static_cast<uint8_t>(message.command);
+  if(opcode < commandHandlers.size() && commandHandlers[opcode].dispatch) /*[[likely]]*/
+  {
+    const auto& handler = commandHandlers[opcode];
+    if(message.length < handler.lengthMin || message.length > handler.lengthMax)
+    {
+      return sendError(message.command, ErrorCode::InvalidCommandPayload);
+    }
+    return handler.dispatch(message);
+  }
+  sendError(message.command, ErrorCode::InvalidCommand);
+}
+
+namespace Accessory
+{
+  static constexpr uint32_t coalesceWindow = 100; // ms, since last activate of the accessory
+  static constexpr uint8_t recentCountMax = 8;
+
+  struct Recent //!< forwarded activate per accessory, until its deactivate
+  {
+    absolute_time_t until = nil_time;
+    AccessoryChannel channel;
+    uint16_t address;
+    uint8_t output;
+  };
+
+  static std::array<Recent, recentCountMax> g_recent;
+
+  void setOutput(AccessoryChannel channel, uint16_t address, uint8_t output, bool activate)
+  {
+    const auto now = get_absolute_time();
+    Recent* entry = nullptr;
+    Recent* oldest = &g_recent[0];
+    for(auto& recent : g_recent)
+    {
+      if(now < recent.until && recent.channel == channel && recent.address == address)
       {
-        return send(Error(message.command, ErrorCode::InvalidCommandPayload));
+        entry = &recent;
+        break;
       }
-      if(XpressNet::enabled())
+      if(recent.until < oldest->until)
       {
-        return send(Error(message.command, ErrorCode::AlreadyInitialized));
+        oldest = &recent;
       }
-      XpressNet::enable();
-      return send(InitXpressNetOk());
+    }
 
-    case Command::InitS88:
+    if(!activate)
     {
-      const auto& initS88 = static_cast<const InitS88&>(message);
-      if(message.size() != sizeof(InitS88) ||
-          initS88.moduleCount < S88::moduleCountMin ||
-          initS88.moduleCount > S88::moduleCountMax ||
-          initS88.clockFrequency < S88::clockFrequencyMin ||
-          initS88.clockFrequency > S88::clockFrequencyMax)
+      if(entry && entry->output == output)
       {
-        return send(Error(message.command, ErrorCode::InvalidCommandPayload));
+        entry->until = nil_time; // the next activate is forwarded
       }
-      if(S88::enabled())
-      {
-        return send(Error(message.command, ErrorCode::AlreadyInitialized));
-      }
-      S88::enable(initS88.moduleCount, initS88.clockFrequency);
-      return send(InitS88Ok());
     }
-  }
+    else if(entry && entry->output == output) // repeated activate
+    {
+      entry->until = make_timeout_time_ms(coalesceWindow);
+      g_accessoryCoalescedCount++;
+      return;
+    }
+    else
+    {
+      // replaces the entry of the other output of the same accessory:
+      *(entry ? entry : oldest) = {make_timeout_time_ms(coalesceWindow), channel, address, output};
+    }
 
-  send(Error(message.command, ErrorCode::InvalidCommand));
+    send(AccessorySetOutput(channel, address, output, activate));
+    g_accessoryCount++;
+  }
 }
 
 namespace Throttle
 {
   void emergencyStop(Channel channel, uint16_t throttleId, uint16_t address)
   {
-    // for now, just sent it to the host
+    auto& loco = Loco::get(address);
+    loco.setOwner(channel, throttleId);
+    loco.eStop = true;
+    loco.speedStep = 0;
+
+    // for now, just sent it to the host, never suppressed
     ThrottleSetSpeedDirection message(channel, throttleId, address);
     message.eStop = 1;
     message.checksum = calcChecksum(message);
     send(message);
+    g_throttleSpeedDirectionCount++;
   }
 
   void setSpeedAndDirection(Channel channel, uint16_t throttleId, uint16_t address, bool eStop, uint8_t speedStep, uint8_t speedSteps, Direction direction)
   {
+    auto& loco = Loco::get(address);
+    loco.setOwner(channel, throttleId);
+    if(!eStop && loco.speedKnown && !loco.eStop &&
+        loco.speedStep == speedStep && loco.speedSteps == speedSteps && loco.direction == direction)
+    {
+      g_throttleSpeedDirectionSuppressedCount++;
+      return; // no change
+    }
+    loco.speedKnown = true;
+    loco.eStop = eStop;
+    loco.speedStep = speedStep;
+    loco.speedSteps = speedSteps;
+    loco.direction = direction;
+
     // for now, just sent it to the host
     ThrottleSetSpeedDirection message(channel, throttleId, address);
     message.eStop = eStop ? 1 : 0;
@@ -202,25 +936,23 @@ namespace Throttle
     message.setDirection = 1;
     message.checksum = calcChecksum(message);
     send(message);
+    g_throttleSpeedDirectionCount++;
   }
 
-  void setFunctions(Channel channel, uint16_t throttleId, uint16_t address, std::initializer_list<std::pair<uint8_t, bool>> values)
+  void setFunctions(Channel channel, uint16_t throttleId, uint16_t address, uint8_t base, uint8_t mask, uint8_t values)
   {
+    auto& loco = Loco::get(address);
+    loco.setOwner(channel, throttleId);
+    const uint8_t changed = loco.updateFunctions(base, mask, values);
+    if(changed == 0)
+    {
+      g_throttleFunctionsSuppressedCount++;
+      return; // no change
+    }
+
     // for now, just sent it to the host
-    uint8_t buffer[sizeof(ThrottleSetFunctions) + values.size()];
-    auto* message = reinterpret_cast<ThrottleSetFunctions*>(buffer);
-    message->command = Command::ThrottleSetFunctions;
-    message->length = sizeof(ThrottleSetFunctions) + values.size() - sizeof(Message) - sizeof(Checksum);
-    message->channel = channel;
-    message->setThrottleId(throttleId);
-    message->setAddress(address);
-    uint8_t index = 0;
-    for(auto& v : values)
-    {
-      message->setFunction(index++, v.first, v.second);
-    }
-    updateChecksum(*message);
-    send(*message);
+    send(ThrottleSetFunctionMask(channel, throttleId, address, base, changed, values));
+    g_throttleFunctionsCount++;
   }
 }
 
@@ -23,10 +23,9 @@
 #define TRAINTASTICCS_TRAINTASTICCS_HPP
 
 #include <cstdint>
-#include <initializer_list>
-#include <utility>
 
 #include "direction.hpp"
+#include "types.hpp"
 #include "throttle/channel.hpp"
 
 namespace TraintasticCS
@@ -35,15 +34,24 @@ namespace TraintasticCS
 void init();
 void process();
 
+namespace Accessory
+{
+  /**
+   * Forward an accessory command to the host, repeats and the deactivate
+   * of an output shortly after its activate are coalesced.
+   */
+  void setOutput(AccessoryChannel channel, uint16_t address, uint8_t output, bool activate);
+}
+
 namespace Throttle
 {
   void emergencyStop(Channel channel, uint16_t throttleId, uint16_t address);
   void setSpeedAndDirection(Channel channel, uint16_t throttleId, uint16_t address, bool eStop, uint8_t speedStep, uint8_t speedSteps, Direction direction);
-  void setFunctions(Channel channel, uint16_t throttleId, uint16_t address, std::initializer_list<std::pair<uint8_t, bool>> values);
+  void setFunctions(Channel channel, uint16_t throttleId, uint16_t address, uint8_t base, uint8_t mask, uint8_t values);
 
   inline void setFunction(Channel channel, uint16_t throttleId, uint16_t address, uint8_t number, bool value)
   {
-    setFunctions(channel, throttleId, address, {{number, value}});
+    setFunctions(channel, throttleId, address, number, 0x01, value ? 0x01 : 0x00);
   }
 }
 
@@ -34,6 +34,12 @@ enum class InputChannel : uint8_t
   S88 = 3,
 };
 
+enum class AccessoryChannel : uint8_t
+{
+  LocoNet = 1,
+  XpressNet = 2,
+};
+
 enum class InputState : uint8_t
 {
   Unknown = 0,
@@ -41,6 +47,13 @@ enum class InputState : uint8_t
   High = 2,
 };
 
+enum class InputFilterType : uint8_t
+{
+  None = 0,
+  Delay = 1,
+  NOfM = 2,
+};
+
 }
 
 #endif
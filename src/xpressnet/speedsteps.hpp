@@ -0,0 +1,197 @@
+/**
+ * This file is part of the Traintastic CS RP2040 firmware,
+ * see <https://github.com/traintastic/traintastic-cs-rp2040>.
+ *
+ * Copyright (C) 2024 Reinder Feenstra
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef XPRESSNET_SPEEDSTEPS_HPP
+#define XPRESSNET_SPEEDSTEPS_HPP
+
+#include <array>
+#include <cstdint>
+
+namespace XpressNet {
+
+/**
+ * Speed byte decode tables, indexed by the speed byte without the direction
+ * bit. Each entry is the normalised speed step (0 is stop, 1..speedSteps) in
+ * bits 0..6 and the emergency stop flag in bit 7.
+ */
+namespace SpeedSteps {
+
+constexpr uint8_t eStopFlag = 0x80;
+using Table = std::array<uint8_t, 128>;
+
+//! 14 steps: 0=stop, 1=emergency stop, 2..15=step 1..14
+constexpr Table table14 = []()
+  {
+    Table table{};
+    for(uint8_t i = 0; i < table.size(); ++i)
+    {
+      const uint8_t value = i & 0x0F;
+      table[i] = (value == 1) ? eStopFlag : (value > 1) ? value - 1 : 0;
+    }
+    return table;
+  }();
+
+/**
+ * 27 and 28 steps, the speed byte is 0 0 0 S0 S4 S3 S2 S1, with S0 as least significant bit:
+ * 0..1=stop, 2..3=emergency stop, 4..31=step 1..28.
+ * In 27 step mode 31 is unused and handled as emergency stop.
+ */
+template<uint8_t SpeedSteps>
+constexpr Table table2x = []()
+  {
+    static_assert(SpeedSteps == 27 || SpeedSteps == 28);
+    Table table{};
+    for(uint8_t i = 0; i < table.size(); ++i)
+    {
+      const uint8_t value = ((i & 0x0F) << 1) | ((i & 0x10) >> 4);
+      if(value <= 1)
+      {
+        table[i] = 0;
+      }
+      else if(value <= 3 || value - 3 > SpeedSteps)
+      {
+        table[i] = eStopFlag;
+      }
+      else
+      {
+        table[i] = value - 3;
+      }
+    }
+    return table;
+  }();
+
+constexpr const Table& table27 = table2x<27>;
+constexpr const Table& table28 = table2x<28>;
+
+//! 128 steps: 0=stop, 1=emergency stop, 2..127=step 1..126
+constexpr Table table128 = []()
+  {
+    Table table{};
+    for(uint8_t i = 0; i < table.size(); ++i)
+    {
+      table[i] = (i == 1) ? eStopFlag : (i > 1) ? i - 1 : 0;
+    }
+    return table;
+  }();
+
+constexpr uint8_t step(const Table& table, uint8_t speedByte)
+{
+  return table[speedByte & 0x7F] & ~eStopFlag;
+}
+
+constexpr bool eStop(const Table& table, uint8_t speedByte)
+{
+  return table[speedByte & 0x7F] & eStopFlag;
+}
+
+//! Encode a normalised speed step to a speed byte without direction bit, inverse of the tables
+constexpr uint8_t encode(uint8_t speedSteps, bool eStop, uint8_t step)
+{
+  switch(speedSteps)
+  {
+    case 14:
+      return eStop ? 1 : (step != 0 ? step + 1 : 0);
+
+    case 27:
+    case 28:
+    {
+      const uint8_t value = eStop ? 2 : (step != 0 ? step + 3 : 0);
+      return ((value & 0x01) << 4) | (value >> 1);
+    }
+    default: // 126
+      return eStop ? 1 : (step != 0 ? step + 1 : 0);
+  }
+}
+
+// Check against the XpressNet specification, direction bit must be ignored:
+static_assert(step(table14, 0x00) == 0 && !eStop(table14, 0x00));
+static_assert(step(table14, 0x80) == 0 && !eStop(table14, 0x80));
+static_assert(eStop(table14, 0x01) && eStop(table14, 0x81));
+static_assert(step(table14, 0x02) == 1 && step(table14, 0x8F) == 14);
+
+static_assert(step(table27, 0x00) == 0 && !eStop(table27, 0x00)); // stop
+static_assert(step(table27, 0x10) == 0 && !eStop(table27, 0x10)); // stop, ignore direction
+static_assert(eStop(table27, 0x01) && eStop(table27, 0x11)); // emergency stop (ignore direction)
+static_assert(step(table27, 0x02) == 1 && step(table27, 0x12) == 2);
+static_assert(step(table27, 0x0F) == 27 && !eStop(table27, 0x0F));
+static_assert(eStop(table27, 0x1F)); // unused
+
+static_assert(step(table28, 0x00) == 0 && !eStop(table28, 0x00)); // stop
+static_assert(step(table28, 0x10) == 0 && !eStop(table28, 0x10)); // stop, ignore direction
+static_assert(eStop(table28, 0x01) && eStop(table28, 0x11)); // emergency stop (ignore direction)
+static_assert(step(table28, 0x02) == 1 && step(table28, 0x12) == 2);
+static_assert(step(table28, 0x03) == 3 && step(table28, 0x13) == 4);
+static_assert(step(table28, 0x0F) == 27 && step(table28, 0x9F) == 28);
+
+static_assert(step(table128, 0x00) == 0 && !eStop(table128, 0x00));
+static_assert(eStop(table128, 0x01) && eStop(table128, 0x81));
+static_assert(step(table128, 0x02) == 1 && step(table128, 0xFF) == 126);
+
+// Every speed step is reachable exactly once:
+template<uint8_t SpeedSteps>
+constexpr bool isComplete(const Table& table, uint8_t mask)
+{
+  for(uint8_t s = 1; s <= SpeedSteps; ++s)
+  {
+    uint8_t count = 0;
+    for(uint8_t i = 0; i <= mask; ++i)
+    {
+      if((table[i] & ~eStopFlag) == s)
+      {
+        count++;
+      }
+    }
+    if(count != 1)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static_assert(isComplete<14>(table14, 0x0F));
+static_assert(isComplete<27>(table27, 0x1F));
+static_assert(isComplete<28>(table28, 0x1F));
+static_assert(isComplete<126>(table128, 0x7F));
+
+template<uint8_t SpeedSteps>
+constexpr bool isInverse(const Table& table)
+{
+  for(uint8_t s = 0; s <= SpeedSteps; ++s)
+  {
+    if(table[encode(SpeedSteps, false, s)] != s)
+    {
+      return false;
+    }
+  }
+  return table[encode(SpeedSteps, true, 0)] == eStopFlag;
+}
+
+static_assert(isInverse<14>(table14));
+static_assert(isInverse<27>(table27));
+static_assert(isInverse<28>(table28));
+static_assert(isInverse<126>(table128));
+
+}
+
+}
+
+#endif
@@ -21,10 +21,19 @@
 
 #include "xpressnet.hpp"
 #include "xpressnet.pio.h"
+#include "speedsteps.hpp"
 
-#include <pico/stdlib.h> // sleep_us
+#include <algorithm>
+#include <array>
+#include <pico/stdlib.h>
+#include <hardware/dma.h>
+#include <hardware/irq.h>
+#include <hardware/sync.h>
 
 #include "../config.hpp"
+#include "../s88/s88.hpp"
+#include "../traintasticcs/input.hpp"
+#include "../traintasticcs/loco.hpp"
 #include "../traintasticcs/traintasticcs.hpp"
 #include "../utils/bit.hpp"
 #include "../utils/endian.hpp"
@@ -32,24 +41,189 @@
 
 namespace XpressNet {
 
+//! Feedback data byte: I T T N Z3 Z2 Z1 Z0, TT=10 is feedback module
+constexpr uint8_t makeFeedbackData(uint8_t nibble, uint8_t states)
+{
+  return 0x40 | (nibble << 4) | ((states >> (4 * nibble)) & 0x0F);
+}
+
+constexpr uint32_t callByteTime = 190; // us, 11 bits at 62500 baud plus margin
+constexpr uint32_t responseTimeout = 120; // us, after the call byte
+constexpr uint8_t probeDivider = 4; // each pass probes a quarter of the inactive addresses
+constexpr uint8_t feedbackAddressBase = 64; // feedback modules use accessory addresses 64..127, S88 input 1 is address 64 lower nibble bit 0
+constexpr uint8_t feedbackModuleCount = 64;
+static_assert(8 * feedbackModuleCount >= S88::inputCountMax);
+constexpr uint8_t feedbackMessageCountMax = (2 * feedbackModuleCount + 6) / 7; // all nibbles, seven per message
+
+constexpr uint8_t broadcastRepeatCount = 2; // power and emergency stop broadcasts are sent three times
+constexpr uint txRingSizeBits = 8; // 2^8 bytes = 64 words, DMA read ring wraps at this size
+constexpr uint16_t txRingSize = (1u << txRingSizeBits) / sizeof(uint32_t);
+
 static bool g_enabled = false;
+static uint g_txOffset;
+static uint g_txDmaChannel;
+alignas(1u << txRingSizeBits) static std::array<uint32_t, txRingSize> g_txRing; // 9 bit words for the TX state machine
+static volatile uint16_t g_txRingHead = 0;
+static volatile uint16_t g_txRingTail = 0;
+static volatile uint16_t g_txDmaCount = 0; // number of words of the running DMA transfer
+
+//! Transmit priority, lower value is sent first
+enum class Priority : uint8_t
+{
+  Urgent = 0, //!< emergency stop and power broadcasts
+  Response = 1, //!< answers to the device being polled
+  Normal = 2, //!< feedback and repeated broadcasts, normal inquiries are sent when nothing is queued
+};
+
+struct TxMessage
+{
+  uint8_t callByte;
+  uint8_t repeat; //!< number of copies to send after this one, at normal priority
+  uint8_t data[1 + 15]; //!< header and data bytes, without checksum
+};
+
+template<uint8_t N>
+struct TxQueue
+{
+  std::array<TxMessage, N> messages;
+  uint8_t head; //!< index of first message
+  uint8_t count;
+
+  void clear()
+  {
+    head = 0;
+    count = 0;
+  }
+
+  bool push(const TxMessage& message)
+  {
+    if(count == N)
+    {
+      return false;
+    }
+    messages[(head + count) % N] = message;
+    count++;
+    return true;
+  }
+
+  bool pop(TxMessage& message)
+  {
+    if(count == 0)
+    {
+      return false;
+    }
+    message = messages[head];
+    head = (head + 1) % N;
+    count--;
+    return true;
+  }
+};
+
+constexpr uint8_t urgentQueueSize = 4;
+constexpr uint8_t responseQueueSize = 4;
+constexpr uint8_t normalQueueSize = feedbackMessageCountMax + broadcastRepeatCount * urgentQueueSize; // all feedback broadcasts and repeats of the urgent queue
+
+static TxQueue<urgentQueueSize> g_txUrgent;
+static TxQueue<responseQueueSize> g_txResponse;
+static TxQueue<normalQueueSize> g_txNormal;
+static uint32_t g_txDroppedCount = 0;
+static uint32_t g_rxFramingErrorCount = 0;
+static uint32_t g_rxOverflowCount = 0;
+struct Device
+{
+  bool active; // responded since XpressNet was enabled
+  uint32_t lastPoll; // time_us_32()
+  uint32_t pollInterval; // us, last measured
+  uint32_t responseCount;
+};
+
+static std::array<Device, addressMax + 1> g_devices; // index is address, 0 is unused
+static uint8_t g_pollPosition; // last active address polled in current pass
+static uint8_t g_probeAddress; // last inactive address probed
+static uint8_t g_probesLeft; // inactive addresses still to probe in current pass
+static std::array<uint8_t, feedbackModuleCount> g_feedback; // states last broadcast
+static uint32_t g_feedbackChangeCount;
 static uint8_t g_address;
 static uint8_t g_rxBuffer[32];
 static uint8_t g_rxBufferCount;
-static absolute_time_t g_nextNormalInquiry;
+static absolute_time_t g_txAllowed; // bus is free for the command station, i.e. outside the response window
 
 static void received();
 
-void init()
+//! Must be called with interrupts disabled
+static void txStart()
 {
-  gpio_init(XPRESSNET_PIN_TX_EN);
-  gpio_set_dir(XPRESSNET_PIN_TX_EN, GPIO_OUT);
+  const uint16_t count = (g_txRingHead - g_txRingTail) & (txRingSize - 1);
+  if(g_txDmaCount == 0 && count != 0)
+  {
+    g_txDmaCount = count;
+    dma_channel_transfer_from_buffer_now(g_txDmaChannel, &g_txRing[g_txRingTail], count);
+  }
+}
 
+static void dmaIRQ()
+{
+  if(!dma_channel_get_irq0_status(g_txDmaChannel))
+  {
+    return; // not for us
+  }
+  dma_channel_acknowledge_irq0(g_txDmaChannel);
+
+  g_txRingTail = (g_txRingTail + g_txDmaCount) & (txRingSize - 1);
+  g_txDmaCount = 0;
+  txStart(); // words queued while DMA was running
+}
+
+//! Bus is idle, all queued words are sent including the last stop bit
+static bool txIdle()
+{
+  return
+    g_txRingHead == g_txRingTail &&
+    pio_sm_is_tx_fifo_empty(XPRESSNET_PIO, XPRESSNET_SM_TX) &&
+    pio_sm_get_pc(XPRESSNET_PIO, XPRESSNET_SM_TX) == g_txOffset + xpressnet_tx_offset_idle;
+}
+
+static void txWrite(const uint32_t* words, uint8_t count)
+{
+  // wait for room, only if a lot of messages are queued at once:
+  while(((g_txRingTail - g_txRingHead - 1) & (txRingSize - 1)) < count)
+  {
+    tight_loop_contents();
+  }
+
+  const uint32_t status = save_and_disable_interrupts();
+  uint16_t head = g_txRingHead;
+  for(uint8_t i = 0; i < count; ++i)
+  {
+    g_txRing[head] = words[i];
+    head = (head + 1) & (txRingSize - 1);
+  }
+  g_txRingHead = head;
+  txStart();
+  restore_interrupts(status);
+}
+
+void init()
+{
   gpio_init(XPRESSNET_PIN_POWER);
   gpio_set_dir(XPRESSNET_PIN_POWER, GPIO_OUT);
 
   xpressnet_rx_program_init(XPRESSNET_PIO, XPRESSNET_SM_RX, XPRESSNET_PIN_RX);
-  xpressnet_tx_program_init(XPRESSNET_PIO, XPRESSNET_SM_TX, XPRESSNET_PIN_TX, XPRESSNET_PIN_TX_EN);
+  g_txOffset = xpressnet_tx_program_init(XPRESSNET_PIO, XPRESSNET_SM_TX, XPRESSNET_PIN_TX, XPRESSNET_PIN_TX_EN);
+
+  // setup dma, TX ring -> PIO TX FIFO:
+  g_txDmaChannel = dma_claim_unused_channel(true);
+  dma_channel_config config = dma_channel_get_default_config(g_txDmaChannel);
+  channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+  channel_config_set_read_increment(&config, true);
+  channel_config_set_write_increment(&config, false);
+  channel_config_set_ring(&config, false, txRingSizeBits);
+  channel_config_set_dreq(&config, pio_get_dreq(XPRESSNET_PIO, XPRESSNET_SM_TX, true));
+  dma_channel_configure(g_txDmaChannel, &config, &XPRESSNET_PIO->txf[XPRESSNET_SM_TX], g_txRing.data(), 0, false);
+
+  dma_channel_set_irq0_enabled(g_txDmaChannel, true);
+  irq_add_shared_handler(DMA_IRQ_0, dmaIRQ, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+  irq_set_enabled(DMA_IRQ_0, true);
 }
 
 bool enabled()
@@ -60,12 +234,28 @@ bool enabled()
 void enable()
 {
   g_address = 0;
+  g_pollPosition = 0;
+  g_probeAddress = 0;
+  g_probesLeft = 0;
+  g_devices.fill(Device{false, 0, 0, 0});
+  g_feedback.fill(0);
+  g_feedbackChangeCount = TraintasticCS::Input::changeCount(TraintasticCS::InputChannel::S88) - 1; // broadcast all active inputs
   g_rxBufferCount = 0;
-  g_nextNormalInquiry = make_timeout_time_ms(1000);
+  g_rxFramingErrorCount = 0;
+  g_rxOverflowCount = 0;
+  g_txUrgent.clear();
+  g_txResponse.clear();
+  g_txNormal.clear();
+  g_txDroppedCount = 0;
+  g_txAllowed = make_timeout_time_ms(1000);
 
   pio_sm_set_enabled(XPRESSNET_PIO, XPRESSNET_SM_RX, false);
   pio_sm_set_enabled(XPRESSNET_PIO, XPRESSNET_SM_TX, false);
 
+  g_txRingHead = 0;
+  g_txRingTail = 0;
+  g_txDmaCount = 0;
+
   pio_sm_clear_fifos(XPRESSNET_PIO, XPRESSNET_SM_RX);
   pio_sm_clear_fifos(XPRESSNET_PIO, XPRESSNET_SM_TX);
 
@@ -89,13 +279,15 @@ void disable()
 
   gpio_put(XPRESSNET_PIN_POWER, 0);
 
+  dma_channel_abort(g_txDmaChannel);
   pio_sm_set_enabled(XPRESSNET_PIO, XPRESSNET_SM_RX, false);
   pio_sm_set_enabled(XPRESSNET_PIO, XPRESSNET_SM_TX, false);
+  pio_sm_exec(XPRESSNET_PIO, XPRESSNET_SM_TX, pio_encode_jmp(g_txOffset + xpressnet_tx_offset_idle) | pio_encode_sideset(1, 0)); // disable driver
 
   g_enabled = false;
 }
 
-void sendCallByte(uint8_t value)
+static uint32_t callByteWord(uint8_t value)
 {
   uint8_t bits = 0;
   for(uint8_t m = 1; m < 0x80; m <<= 1)
@@ -109,47 +301,222 @@ void sendCallByte(uint8_t value)
   {
     value |= 0x80;
   }
+  return 0x0100u | value;
+}
 
-  gpio_put(XPRESSNET_PIN_TX_EN, 1);
-  pio_sm_put(XPRESSNET_PIO, XPRESSNET_SM_TX, 0x0100u | value);
+void sendNormalInquiry(uint8_t address)
+{
+  const uint32_t word = callByteWord(0x40 | address);
+  txWrite(&word, 1);
+}
 
-  sleep_us(190); // FIXME
-  gpio_put(XPRESSNET_PIN_TX_EN, 0); // FIXME
+static void transmit(const TxMessage& message)
+{
+  const uint8_t dataLength = message.data[0] & 0x0F;
+  uint32_t words[1 + 16 + 1];
+  uint8_t count = 0;
+  words[count++] = callByteWord(message.callByte);
+  uint8_t checksum = 0;
+  for(uint8_t i = 0; i <= dataLength; ++i)
+  {
+    words[count++] = message.data[i];
+    checksum ^= message.data[i];
+  }
+  words[count++] = checksum;
+  txWrite(words, count);
 }
 
-void sendNormalInquiry(uint8_t address)
+/**
+ * \return \c false if the queue is full and the message is dropped.
+ */
+static bool enqueue(Priority priority, const TxMessage& message)
 {
-  sendCallByte(0x40 | address);
+  bool queued = false;
+  switch(priority)
+  {
+    case Priority::Urgent:
+      queued = g_txUrgent.push(message);
+      break;
+
+    case Priority::Response:
+      queued = g_txResponse.push(message);
+      break;
+
+    case Priority::Normal:
+      queued = g_txNormal.push(message);
+      break;
+  }
+  if(!queued) /*[[unlikely]]*/
+  {
+    g_txDroppedCount++;
+  }
+  return queued;
 }
 
-void send(uint8_t callByte, const uint8_t* message)
+static bool send(Priority priority, uint8_t callByte, const uint8_t* message, uint8_t repeat = 0)
 {
-  uint8_t bits = 0;
-  for(uint8_t m = 1; m < 0x80; m <<= 1)
+  TxMessage txMessage;
+  txMessage.callByte = callByte;
+  txMessage.repeat = repeat;
+  std::copy_n(message, 1 + (message[0] & 0x0F), txMessage.data);
+  return enqueue(priority, txMessage);
+}
+
+//! Answer the device being polled
+static void respond(const uint8_t* message)
+{
+  send(Priority::Response, 0x60 | g_address, message);
+}
+
+//! Broadcast power and emergency stop state changes, the copies are interleaved with other traffic
+static void broadcastUrgent(const uint8_t* message)
+{
+  send(Priority::Urgent, 0x60, message, broadcastRepeatCount);
+}
+
+/**
+ * Transmit the first queued message with the highest priority.
+ * \return \c true if something was sent.
+ */
+static bool transmitNext()
+{
+  TxMessage message;
+  if(!g_txUrgent.pop(message) && !g_txResponse.pop(message) && !g_txNormal.pop(message))
   {
-    if(callByte & m)
+    return false;
+  }
+
+  transmit(message);
+
+  if(message.repeat != 0)
+  {
+    message.repeat--;
+    enqueue(Priority::Normal, message);
+  }
+  return true;
+}
+
+/**
+ * Every pass polls all active devices, i.e. that ever responded, followed by a
+ * probe of a quarter of the inactive addresses to discover new devices. A pass
+ * never exceeds the 31 slots of plain round-robin, so a known device is never
+ * polled less often than with round-robin, even when it was idle for a long time.
+ */
+static uint8_t nextAddress()
+{
+  if(g_probesLeft == 0)
+  {
+    for(uint8_t address = g_pollPosition + 1; address <= addressMax; ++address)
     {
-      bits++;
+      if(g_devices[address].active)
+      {
+        g_pollPosition = address;
+        return address;
+      }
     }
+
+    // active devices polled, continue with probing inactive addresses:
+    g_pollPosition = 0;
+    const auto inactiveCount = std::count_if(g_devices.begin() + addressMin, g_devices.end(),
+      [](const Device& device)
+      {
+        return !device.active;
+      });
+    if(inactiveCount == 0) // all addresses are active
+    {
+      g_pollPosition = addressMin;
+      return addressMin;
+    }
+    g_probesLeft = (inactiveCount + probeDivider - 1) / probeDivider;
   }
-  if(bits & 1) // odd
+
+  g_probesLeft--;
+  for(uint8_t i = 0; i < addressMax; ++i)
   {
-    callByte |= 0x80;
+    g_probeAddress = g_probeAddress % addressMax + 1;
+    if(!g_devices[g_probeAddress].active)
+    {
+      break;
+    }
   }
+  return g_probeAddress;
+}
 
-  const uint8_t dataLength = message[0] & 0x0F;
-  gpio_put(XPRESSNET_PIN_TX_EN, 1);
-  pio_sm_put(XPRESSNET_PIO, XPRESSNET_SM_TX, 0x0100u | callByte);
-  uint8_t checksum = 0;
-  for(uint8_t i = 0; i <= dataLength; ++i)
+static uint8_t getFeedback(uint8_t module)
+{
+  uint32_t values = 0;
+  TraintasticCS::Input::getStates(TraintasticCS::InputChannel::S88, 1 + 8 * module, 8, values);
+  return static_cast<uint8_t>(values);
+}
+
+static void respondFeedback(uint8_t module, uint8_t nibble)
+{
+  const uint8_t msg[3] = {0x42, static_cast<uint8_t>(feedbackAddressBase + module), makeFeedbackData(nibble, getFeedback(module))};
+  respond(msg);
+}
+
+/**
+ * Queue a feedback broadcast, the nibbles are marked as broadcast only if it is queued.
+ * \return \c false if the queue is full.
+ */
+static bool queueFeedback(uint8_t* msg, uint8_t count)
+{
+  msg[0] = 0x40 | (2 * count);
+  if(!send(Priority::Normal, 0x60, msg))
+  {
+    return false;
+  }
+  for(uint8_t i = 0; i < count; ++i)
+  {
+    const uint8_t module = msg[1 + 2 * i] - feedbackAddressBase;
+    const uint8_t shift = (msg[2 + 2 * i] & 0x10) ? 4 : 0; // N: upper nibble
+    g_feedback[module] = (g_feedback[module] & ~(0x0F << shift)) | ((msg[2 + 2 * i] & 0x0F) << shift);
+  }
+  return true;
+}
+
+/**
+ * Queue broadcasts of feedback nibbles that changed since the last broadcast, up to seven per message.
+ */
+static void broadcastFeedback()
+{
+  const uint32_t changeCount = TraintasticCS::Input::changeCount(TraintasticCS::InputChannel::S88);
+  if(changeCount == g_feedbackChangeCount) /*[[likely]]*/
+  {
+    return;
+  }
+
+  uint8_t msg[1 + 2 * 7];
+  uint8_t count = 0;
+  bool queued = true;
+  for(uint8_t module = 0; module < feedbackModuleCount; ++module)
+  {
+    const uint8_t states = getFeedback(module);
+    const uint8_t diff = states ^ g_feedback[module];
+
+    for(uint8_t nibble = 0; nibble < 2; ++nibble)
+    {
+      if(diff & (0x0F << (4 * nibble)))
+      {
+        msg[1 + 2 * count] = feedbackAddressBase + module;
+        msg[2 + 2 * count] = makeFeedbackData(nibble, states);
+        if(++count == 7)
+        {
+          queued &= queueFeedback(msg, count);
+          count = 0;
+        }
+      }
+    }
+  }
+  if(count != 0)
   {
-    pio_sm_put(XPRESSNET_PIO, XPRESSNET_SM_TX, message[i]);
-    checksum ^= message[i];
+    queued &= queueFeedback(msg, count);
   }
-  pio_sm_put(XPRESSNET_PIO, XPRESSNET_SM_TX, checksum);
 
-  sleep_us(190 * (3 + dataLength)); // FIXME
-  gpio_put(XPRESSNET_PIN_TX_EN, 0); // FIXME
+  if(queued) // else retry the dropped nibbles next time
+  {
+    g_feedbackChangeCount = changeCount;
+  }
 }
 
 void process()
@@ -159,12 +526,24 @@ void process()
     return;
   }
 
+  if(constexpr uint32_t rxStall = 1u << (PIO_FDEBUG_RXSTALL_LSB + XPRESSNET_SM_RX); XPRESSNET_PIO->fdebug & rxStall) /*[[unlikely]]*/
+  {
+    XPRESSNET_PIO->fdebug = rxStall; // write 1 to clear
+    g_rxOverflowCount++;
+    g_rxBufferCount = 0; // message is incomplete
+  }
+
   while(!pio_sm_is_rx_fifo_empty(XPRESSNET_PIO, XPRESSNET_SM_RX))
   {
-    g_nextNormalInquiry = at_the_end_of_time;
+    g_txAllowed = at_the_end_of_time;
 
-    uint16_t value = pio_sm_get(XPRESSNET_PIO, XPRESSNET_SM_RX) >> (32 - 9);
-    if((value & 0x100) == 0) // data byte
+    uint16_t value = pio_sm_get(XPRESSNET_PIO, XPRESSNET_SM_RX) >> (32 - 10);
+    if((value & 0x200) == 0) // stop bit must be 1
+    {
+      g_rxFramingErrorCount++;
+      g_rxBufferCount = 0; // drop message
+    }
+    else if((value & 0x100) == 0) // data byte
     {
       g_rxBuffer[g_rxBufferCount] = static_cast<uint8_t>(value);
       g_rxBufferCount++;
@@ -184,6 +563,9 @@ void process()
 
       if(checksum == g_rxBuffer[length - 1])
       {
+        auto& device = g_devices[g_address];
+        device.responseCount++;
+        device.active = true;
         received();
       }
       g_rxBufferCount = 0;
@@ -191,20 +573,133 @@ void process()
 
     if(g_rxBufferCount == 0)
     {
-      g_nextNormalInquiry = make_timeout_time_us(25);
+      g_txAllowed = make_timeout_time_us(25);
     }
   }
 
-  if(pio_sm_is_tx_fifo_empty(XPRESSNET_PIO, XPRESSNET_SM_TX) &&
-      get_absolute_time() >= g_nextNormalInquiry)
+  // one message at a time, so an urgent message never waits for more than the one being sent:
+  if(txIdle() &&
+      get_absolute_time() >= g_txAllowed)
   {
-    if(++g_address > 31)
+    if(transmitNext())
     {
-      g_address = 1;
+      return;
     }
+
+    broadcastFeedback();
+    if(transmitNext())
+    {
+      return;
+    }
+
+    g_address = nextAddress();
+    auto& device = g_devices[g_address];
+    const uint32_t now = time_us_32();
+    if(device.lastPoll != 0)
+    {
+      device.pollInterval = now - device.lastPoll;
+    }
+    device.lastPoll = now;
     sendNormalInquiry(g_address);
-    g_nextNormalInquiry = make_timeout_time_us(120);
+    g_txAllowed = make_timeout_time_us(callByteTime + responseTimeout);
+  }
+}
+
+Statistics getStatistics()
+{
+  return {g_rxFramingErrorCount, g_rxOverflowCount, g_txDroppedCount};
+}
+
+DeviceStatistics getDeviceStatistics(uint8_t address)
+{
+  if(address < addressMin || address > addressMax)
+  {
+    return {0, 0};
+  }
+  return {g_devices[address].pollInterval, g_devices[address].responseCount};
+}
+
+//! Queries don't add the locomotive to the table, that could push out a locomotive in use
+static const TraintasticCS::Loco::State& findLoco(uint16_t address)
+{
+  static const TraintasticCS::Loco::State unknown{};
+  const auto* loco = TraintasticCS::Loco::find(address);
+  return loco ? *loco : unknown;
+}
+
+static void sendLocoInfo(uint16_t address)
+{
+  const auto& loco = findLoco(address);
+  const bool busy = loco.controlled() && !loco.isOwner(TraintasticCS::Throttle::Channel::XpressNet, g_address);
+  const uint8_t speedSteps = loco.speedKnown ? loco.speedSteps : 126;
+
+  uint8_t identification;
+  switch(speedSteps)
+  {
+    case 14:
+      identification = 0x00;
+      break;
+    case 27:
+      identification = 0x01;
+      break;
+    case 28:
+      identification = 0x02;
+      break;
+    default:
+      identification = 0x04;
+      break;
+  }
+  if(busy)
+  {
+    identification |= 0x08;
+  }
+
+  uint8_t speed = SpeedSteps::encode(speedSteps, loco.speedKnown && loco.eStop, loco.speedKnown ? loco.speedStep : 0);
+  if(!loco.speedKnown || loco.direction == TraintasticCS::Direction::Forward)
+  {
+    speed |= 0x80;
+  }
+
+  uint8_t fa = loco.function(0) ? 0x10 : 0x00; // 0 0 0 F0 F4 F3 F2 F1
+  for(uint8_t i = 1; i <= 4; ++i)
+  {
+    if(loco.function(i))
+    {
+      fa |= 1 << (i - 1);
+    }
+  }
+  uint8_t fb = 0; // F12 F11 F10 F9 F8 F7 F6 F5
+  for(uint8_t i = 5; i <= 12; ++i)
+  {
+    if(loco.function(i))
+    {
+      fb |= 1 << (i - 5);
+    }
+  }
+
+  const uint8_t msg[5] = {0xE4, identification, speed, fa, fb};
+  respond(msg);
+}
+
+static void sendLocoFunctionsF13F28(uint16_t address)
+{
+  const auto& loco = findLoco(address);
+  uint8_t fc = 0; // F20 F19 F18 F17 F16 F15 F14 F13
+  uint8_t fd = 0; // F28 F27 F26 F25 F24 F23 F22 F21
+  for(uint8_t i = 0; i < 8; ++i)
+  {
+    if(loco.function(13 + i))
+    {
+      fc |= 1 << i;
+    }
+    if(loco.function(21 + i))
+    {
+      fd |= 1 << i;
+    }
   }
+
+  const uint8_t msg[4] = {0xE3, 0x52, fc, fd};
+  respond(msg);
 }
 
 static void received()
@@ -212,35 +707,66 @@ static void received()
   const uint8_t* message = g_rxBuffer;
   switch(message[0])
   {
+    case 0x42: // Accessory decoder information request
+      if(message[1] >= feedbackAddressBase && message[1] < feedbackAddressBase + feedbackModuleCount)
+      {
+        respondFeedback(message[1] - feedbackAddressBase, message[2] & 0x01);
+      }
+      break;
+
+    case 0x52: // Accessory decoder operation request: AAAAAAAA 1000DBBP
+    {
+      static constexpr uint8_t ack[2] = {0x01, 0x04}; // Instruction acknowledgement
+      respond(ack);
+
+      TraintasticCS::Accessory::setOutput(
+        TraintasticCS::AccessoryChannel::XpressNet,
+        1 + 4 * message[1] + ((message[2] >> 1) & 0x03),
+        message[2] & 0x01,
+        bit<3>(message[2])
+      );
+      break;
+    }
+    case 0xE3:
+      switch(message[1])
+      {
+        case 0x00: // Locomotive information request
+          sendLocoInfo(be16(message + 2));
+          break;
+
+        case 0x08: // Function level request F13-F28
+          sendLocoFunctionsF13F28(be16(message + 2));
+          break;
+
+        // 0x09, function status (momentary or on/off) request F13-F28, isn't supported
+      }
+      break;
+
     case 0x21:
       switch(message[1])
       {
         case 0x80: // Stop operations request
         {
           static constexpr uint8_t msg[2] = {0x61, 0x00};
-          send(0x60, msg);
-          send(0x60, msg);
-          send(0x60, msg);
+          broadcastUrgent(msg);
           break;
         }
         case 0x81: // Resume operations request
         {
           static constexpr uint8_t msg[2] = {0x61, 0x01};
-          send(0x60, msg);
-          send(0x60, msg);
-          send(0x60, msg);
+          broadcastUrgent(msg);
           break;
         }
         case 0x24: // Command station status request
         {
           static constexpr uint8_t msg[3] = {0x62, 0x22, 0x00};
-          send(0x60 | g_address, msg);
+          respond(msg);
           break;
         }
         case 0x21: // Command station software-version request
         {
           static constexpr uint8_t msg[4] = {0x63, 0x21, 0x30, 0x10};
-          send(0x60 | g_address, msg);
+          respond(msg);
           break;
         }
       }
@@ -249,161 +775,112 @@ static void received()
     case 0x80: // Stop all locomotives request (emergency stop)
     {
       static constexpr uint8_t msg[2] = {0x81, 0x00};
-      send(0x60, msg);
-      send(0x60, msg);
-      send(0x60, msg);
+      broadcastUrgent(msg);
       break;
     }
     case 0xE4:
     {
       switch(message[1])
       {
-        case 0x10:
-        case 0x11:
-        case 0x12:
-        case 0x13:
+        case 0x10: // 14 steps
+        case 0x11: // 27 steps
+        case 0x12: // 28 steps
+        case 0x13: // 128 steps
         {
-          bool eStop = false;
-          uint8_t speedStep = 0;
-          uint8_t speedSteps = 0;
-
-          switch(message[1])
-          {
-            case 0x10: // 14 steps
-              TraintasticCS::Throttle::setFunction(
-                TraintasticCS::Throttle::Channel::XpressNet,
-                g_address,
-                be16(message + 2),
-                0,
-                bit<7>(message[4])
-              );
-              speedSteps = 14;
-              speedStep = message[4] & 0x0F;
-              if(speedStep == 1)
-              {
-                eStop = true;
-                speedStep = 0;
-              }
-              else if(speedStep > 1)
-              {
-                speedStep--;
-              }
-              break;
-
-            case 0x11:
-              speedSteps = 27;
-              speedStep = ((message[4] & 0x0F) << 1) | ((message[4] & 0x10) >> 4);
-              if(speedStep >= 4 && speedStep < 31)
-              {
-                speedStep -= 3;
-              }
-              else if(speedStep != 0) // all unused values are eStop too.
-              {
-                eStop = true;
-                speedStep = 0;
-              }
-              break;
-
-            case 0x12:
-              speedSteps = 28;
-              speedStep = ((message[4] & 0x0F) << 1) | ((message[4] & 0x10) >> 4);
-              if(speedStep >= 4)
-              {
-                speedStep -= 3;
-              }
-              else if(speedStep != 0) // all unused values are eStop too.
-              {
-                eStop = true;
-                speedStep = 0;
-              }
-              break;
-
-            case 0x13:
-              speedSteps = 126;
-              speedStep = message[4] & 0x7F;
-              if(speedStep == 1)
-              {
-                eStop = true;
-                speedStep = 0;
-              }
-              else if(speedStep > 1)
-              {
-                speedStep--;
-              }
-              break;
-          }
+          static constexpr const SpeedSteps::Table* tables[4] = {&SpeedSteps::table14, &SpeedSteps::table27, &SpeedSteps::table28, &SpeedSteps::table128};
+          static constexpr uint8_t speedSteps[4] = {14, 27, 28, 126};
+          const uint8_t mode = message[1] & 0x03;
+          const uint8_t decoded = (*tables[mode])[message[4] & 0x7F];
 
           TraintasticCS::Throttle::setSpeedAndDirection(
             TraintasticCS::Throttle::Channel::XpressNet,
             g_address,
             be16(message + 2),
-            eStop,
-            speedStep,
-            speedSteps,
+            decoded & SpeedSteps::eStopFlag,
+            decoded & ~SpeedSteps::eStopFlag,
+            speedSteps[mode],
             bit<7>(message[4]) ? TraintasticCS::Direction::Forward : TraintasticCS::Direction::Reverse
           );
           break;
         }
-        case 0x20: //  Function instruction group 1
+        case 0x20: //  Function instruction group 1: 0 0 0 F0 F4 F3 F2 F1
           TraintasticCS::Throttle::setFunctions(
             TraintasticCS::Throttle::Channel::XpressNet,
             g_address,
             be16(message + 2),
-            {
-              {0, bit<4>(message[4])},
-              {1, bit<0>(message[4])},
-              {2, bit<1>(message[4])},
-              {3, bit<2>(message[4])},
-              {4, bit<3>(message[4])},
-            }
+            0,
+            0x1F,
+            ((message[4] & 0x0F) << 1) | ((message[4] & 0x10) >> 4)
           );
           break;
 
-        case 0x21: // Function instruction group 2
+        case 0x21: // Function instruction group 2: 0 0 0 0 F8 F7 F6 F5
           TraintasticCS::Throttle::setFunctions(
             TraintasticCS::Throttle::Channel::XpressNet,
             g_address,
             be16(message + 2),
-            {
-              {5, bit<0>(message[4])},
-              {6, bit<1>(message[4])},
-              {7, bit<2>(message[4])},
-              {8, bit<3>(message[4])},
-            }
+            5,
+            0x0F,
+            message[4]
           );
           break;
 
-        case 0x22: // Function instruction group 3
+        case 0x22: // Function instruction group 3: 0 0 0 0 F12 F11 F10 F9
           TraintasticCS::Throttle::setFunctions(
             TraintasticCS::Throttle::Channel::XpressNet,
             g_address,
             be16(message + 2),
-            {
-              {9, bit<0>(message[4])},
-              {10, bit<1>(message[4])},
-              {11, bit<2>(message[4])},
-              {12, bit<3>(message[4])},
-            }
+            9,
+            0x0F,
+            message[4]
           );
           break;
 
+        case 0x23: // Function instruction group 4: F20 F19 F18 F17 F16 F15 F14 F13
         case 0xF3: // Roco Multimaus F13-F20
           TraintasticCS::Throttle::setFunctions(
             TraintasticCS::Throttle::Channel::XpressNet,
             g_address,
-            be16(g_rxBuffer + 2),
-            {
-              {13, bit<0>(message[4])},
-              {14, bit<1>(message[4])},
-              {15, bit<2>(message[4])},
-              {16, bit<3>(message[4])},
-              {17, bit<4>(message[4])},
-              {18, bit<5>(message[4])},
-              {19, bit<6>(message[4])},
-              {20, bit<7>(message[4])},
-            }
+            be16(message + 2),
+            13,
+            0xFF,
+            message[4]
           );
           break;
+
+        case 0x28: // Function instruction group 5: F28 F27 F26 F25 F24 F23 F22 F21
+          TraintasticCS::Throttle::setFunctions(
+            TraintasticCS::Throttle::Channel::XpressNet,
+            g_address,
+            be16(message + 2),
+            21,
+            0xFF,
+            message[4]
+          );
+          break;
+      }
+      break;
+    }
+    case 0xE5:
+    {
+      switch(message[1])
+      {
+        case 0x5F: // Binary state: S L6 L5 L4 L3 L2 L1 L0, H7..H0, state number 29..68 are F29..F68
+        {
+          const uint16_t number = (static_cast<uint16_t>(message[5]) << 7) | (message[4] & 0x7F);
+          if(number >= 29 && number <= 68)
+          {
+            TraintasticCS::Throttle::setFunctions(
+              TraintasticCS::Throttle::Channel::XpressNet,
+              g_address,
+              be16(message + 2),
+              static_cast<uint8_t>(number),
+              0x01,
+              bit<7>(message[4]) ? 0x01 : 0x00
+            );
+          }
+          break;
+        }
       }
     }
   }
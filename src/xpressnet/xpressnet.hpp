@@ -22,13 +22,33 @@
 #ifndef XPRESSNET_XPRESSNET_HPP
 #define XPRESSNET_XPRESSNET_HPP
 
+#include <cstdint>
+
 namespace XpressNet {
 
+constexpr uint8_t addressMin = 1;
+constexpr uint8_t addressMax = 31;
+
+struct Statistics
+{
+  uint32_t rxFramingErrors;
+  uint32_t rxOverflows; // RX FIFO was full, byte(s) lost
+  uint32_t txDropped; // transmit queue was full, message lost
+};
+
+struct DeviceStatistics
+{
+  uint32_t pollInterval; // us, last measured
+  uint32_t responseCount;
+};
+
 void init();
 bool enabled();
 void enable();
 void disable();
 void process();
+Statistics getStatistics();
+DeviceStatistics getDeviceStatistics(uint8_t address);
 
 }
 